@@ -1,31 +1,134 @@
 #ifndef MINIJSON_WRITER_H
 #define MINIJSON_WRITER_H
 
+#include <cassert>
+#include <clocale>
 #include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <stdexcept>
 #include <string>
+#include <vector>
 #include <iterator>
 #include <ostream>
+#include <streambuf>
 #include <iomanip>
 #include <locale>
+#include <map>
+#include <limits>
+#include <algorithm>
 
 #define MJW_CPP11_SUPPORTED __cplusplus > 199711L || _MSC_VER >= 1800
 
 #if MJW_CPP11_SUPPORTED
 
 #include <type_traits>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <cstdint>
 #include <cmath>
 #define MJW_LIB_NS std
 #define MJW_ISFINITE(X) std::isfinite(X)
+#define MJW_SIGNBIT(X) std::signbit(X)
 
 #else
 
 #include <boost/type_traits.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/math/special_functions/sign.hpp>
 #include <boost/math/special_functions/fpclassify.hpp>
 #define MJW_LIB_NS boost
 #define MJW_ISFINITE(X) boost::math::isfinite(X)
+#define MJW_SIGNBIT(X) boost::math::signbit(X)
 
 #endif
 
+#if __cplusplus >= 201402L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201402L)
+#define MJW_CONSTEXPR14 constexpr
+#else
+#define MJW_CONSTEXPR14
+#endif
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define MJW_CPP17_SUPPORTED 1
+#include <string_view>
+#else
+#define MJW_CPP17_SUPPORTED 0
+#endif
+
+#if defined(__AVX2__)
+#define MJW_AVX2_SUPPORTED 1
+#include <immintrin.h>
+#else
+#define MJW_AVX2_SUPPORTED 0
+#endif
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+#define MJW_SSSE3_SUPPORTED 1
+#include <tmmintrin.h>
+#else
+#define MJW_SSSE3_SUPPORTED 0
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MJW_SSE2_SUPPORTED 1
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define MJW_SSE2_SUPPORTED 0
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MJW_POSIX_SUPPORTED 1
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#if defined(IOV_MAX)
+#define MJW_IOV_MAX IOV_MAX
+#else
+#define MJW_IOV_MAX 1024 // POSIX does not require IOV_MAX to be defined
+#endif
+#else
+#define MJW_POSIX_SUPPORTED 0
+#endif
+
+// Compressing sinks, enabled by defining these macros (and linking with
+// -lz and -lzstd respectively)
+#if defined(MJW_ENABLE_ZLIB)
+#include <zlib.h>
+#endif
+
+#if defined(MJW_ENABLE_ZSTD)
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+
+#if defined(__linux__)
+#define MJW_UCONTEXT_SUPPORTED 1
+#include <ucontext.h>
+#else
+#define MJW_UCONTEXT_SUPPORTED 0
+#endif
+
+// Counters of the writers' activity (see writer_stats), compiled out unless
+// this macro is defined
+#if defined(MJW_ENABLE_INSTRUMENTATION) && !MJW_CPP11_SUPPORTED
+#error "MJW_ENABLE_INSTRUMENTATION requires C++11"
+#endif
+
 namespace minijson
 {
 
@@ -34,482 +137,6487 @@ enum null_t
     null = 0
 };
 
+// Output formats. A sink writes JSON unless it declares another format with
+// a nested typedef named encoding (see cbor_sink and msgpack_sink).
+struct json_encoding
+{
+};
+
+struct cbor_encoding
+{
+};
+
+struct msgpack_encoding
+{
+};
+
 template<typename V, typename Enable = void>
 struct default_value_writer;
 
-template<typename InputIt>
-void write_array(std::ostream& stream, InputIt begin, InputIt end);
+class counting_sink;
 
-template<typename InputIt, typename ValueWriter>
-void write_array(std::ostream& stream, InputIt begin, InputIt end, ValueWriter value_writer);
+template<typename Sink, typename InputIt>
+void write_array(Sink& sink, InputIt begin, InputIt end);
+
+template<typename Sink, typename InputIt, typename ValueWriter>
+void write_array(Sink& sink, InputIt begin, InputIt end, ValueWriter value_writer);
+
+#if defined(MJW_ENABLE_INSTRUMENTATION)
+// What the writers did on a thread (thread_writer_stats()), or for a single
+// top-level document (see set_document_callback()). The output to
+// counting_sinks is not counted. writer_stats() is all zeros.
+struct writer_stats
+{
+    unsigned long long bytes;
+    unsigned long long integrals;
+    unsigned long long floating_points;
+    unsigned long long strings;
+    unsigned long long nulls;
+    unsigned long long booleans;
+    unsigned long long binaries;
+    // values written by value writers other than minijson's own
+    unsigned long long custom_values;
+    unsigned long long escapes;
+    // the deepest nesting of objects and arrays
+    unsigned max_depth;
+    // top-level objects and arrays closed, and the time spent writing them
+    unsigned long long documents;
+    std::chrono::nanoseconds document_time;
+};
+
+typedef void (*document_callback)(const writer_stats& document);
+#endif
 
 namespace detail
 {
 
-template<bool>
+template<bool, typename T = void>
 struct enable_if;
 
-template<>
-struct enable_if<true>
+template<typename T>
+struct enable_if<true, T>
 {
-    typedef void type;
+    typedef T type;
 };
 
-template<typename InputIt>
-struct get_value_type
+template<typename Sink>
+struct is_ostream
 {
-    typedef typename MJW_LIB_NS::remove_cv<typename std::iterator_traits<InputIt>::value_type>::type type;
+    static const bool value = MJW_LIB_NS::is_base_of<std::ostream, Sink>::value;
 };
 
-namespace
+template<typename Sink>
+struct is_counting_sink
 {
+    static const bool value = MJW_LIB_NS::is_same<Sink, counting_sink>::value;
+};
 
-void adjust_stream_settings(std::ostream& stream)
+#if defined(MJW_ENABLE_INSTRUMENTATION)
+struct instrumentation_state
 {
-    stream.imbue(std::locale::classic());
-    stream << std::resetiosflags(std::ios::showpoint | std::ios::showpos);
-    stream << std::dec << std::setw(0);
+    writer_stats totals;
+    writer_stats document_start; // the totals when the current document was opened
+    unsigned depth;
+    unsigned document_max_depth;
+    std::chrono::steady_clock::time_point document_opened;
+};
+
+// constant-initialised, so that accessing it needs no guard
+inline instrumentation_state& instrumentation()
+{
+    static thread_local instrumentation_state state;
+    return state;
+}
+
+inline std::atomic<document_callback>& document_callback_slot()
+{
+    static std::atomic<document_callback> callback(nullptr);
+    return callback;
 }
+#endif
 
-void write_quoted_string(std::ostream& stream, const char* str)
+enum value_kind
 {
-    stream << '"';
+    INTEGRAL_VALUE,
+    FLOATING_POINT_VALUE,
+    STRING_VALUE,
+    NULL_VALUE,
+    BOOLEAN_VALUE,
+    BINARY_VALUE,
+    CUSTOM_VALUE
+};
 
-    while (*str != '\0')
+// Instrumentation hooks, empty unless MJW_ENABLE_INSTRUMENTATION is defined
+template<typename Sink>
+void count_bytes(std::size_t size)
+{
+#if defined(MJW_ENABLE_INSTRUMENTATION)
+    if (!is_counting_sink<Sink>::value)
     {
-        switch (*str)
-        {
-        case '"':
-            stream << "\\\"";
-            break;
+        instrumentation().totals.bytes += size;
+    }
+#else
+    (void)size;
+#endif
+}
 
-        case '\\':
-            stream << "\\\\";
-            break;
+template<typename Sink>
+void count_values(value_kind kind, std::size_t count = 1)
+{
+#if defined(MJW_ENABLE_INSTRUMENTATION)
+    if (is_counting_sink<Sink>::value)
+    {
+        return;
+    }
+    writer_stats& totals = instrumentation().totals;
+    switch (kind)
+    {
+    case INTEGRAL_VALUE: totals.integrals += count; break;
+    case FLOATING_POINT_VALUE: totals.floating_points += count; break;
+    case STRING_VALUE: totals.strings += count; break;
+    case NULL_VALUE: totals.nulls += count; break;
+    case BOOLEAN_VALUE: totals.booleans += count; break;
+    case BINARY_VALUE: totals.binaries += count; break;
+    case CUSTOM_VALUE: totals.custom_values += count; break;
+    }
+#else
+    (void)kind;
+    (void)count;
+#endif
+}
 
-        case '\n':
-            stream << "\\n";
-            break;
+inline void count_escape()
+{
+#if defined(MJW_ENABLE_INSTRUMENTATION)
+    instrumentation().totals.escapes++;
+#endif
+}
 
-        case '\r':
-            stream << "\\r";
-            break;
+// Documents are delimited by the opening and the closing of the top-level
+// object or array
+template<typename Sink>
+void enter_container()
+{
+#if defined(MJW_ENABLE_INSTRUMENTATION)
+    if (is_counting_sink<Sink>::value)
+    {
+        return;
+    }
+    instrumentation_state& state = instrumentation();
+    if (state.depth++ == 0)
+    {
+        state.document_start = state.totals;
+        state.document_max_depth = 0;
+        state.document_opened = std::chrono::steady_clock::now();
+    }
+    state.document_max_depth = std::max(state.document_max_depth, state.depth);
+    state.totals.max_depth = std::max(state.totals.max_depth, state.depth);
+#endif
+}
 
-        case '\t':
-            stream << "\\t";
-            break;
+template<typename Sink>
+void leave_container()
+{
+#if defined(MJW_ENABLE_INSTRUMENTATION)
+    if (is_counting_sink<Sink>::value)
+    {
+        return;
+    }
+    instrumentation_state& state = instrumentation();
+    if (state.depth == 0 || --state.depth > 0)
+    {
+        return;
+    }
 
-        default:
-            if ((*str > 0 && *str < 32) || *str == 127) // ASCII control characters (NUL is not supported)
-            {
-                stream << std::hex << std::right << std::setfill('0');
-                stream << "\\u" << std::setw(4) << static_cast<unsigned>(*str);
-                stream << std::dec;
-            }
-            else
-            {
-                stream << *str;
-            }
-            break;
-        }
-        str++;
-     }
+    const std::chrono::nanoseconds elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - state.document_opened);
+    state.totals.documents++;
+    state.totals.document_time += elapsed;
 
-     stream << '"';
+    const document_callback callback = document_callback_slot().load(std::memory_order_relaxed);
+    if (callback != nullptr)
+    {
+        const writer_stats& start = state.document_start;
+        writer_stats document = writer_stats();
+        document.bytes = state.totals.bytes - start.bytes;
+        document.integrals = state.totals.integrals - start.integrals;
+        document.floating_points = state.totals.floating_points - start.floating_points;
+        document.strings = state.totals.strings - start.strings;
+        document.nulls = state.totals.nulls - start.nulls;
+        document.booleans = state.totals.booleans - start.booleans;
+        document.binaries = state.totals.binaries - start.binaries;
+        document.custom_values = state.totals.custom_values - start.custom_values;
+        document.escapes = state.totals.escapes - start.escapes;
+        document.max_depth = state.document_max_depth;
+        document.documents = 1;
+        document.document_time = elapsed;
+        callback(document);
+    }
+#endif
 }
 
-} // unnamed namespace
+#if defined(MJW_ENABLE_INSTRUMENTATION)
+typedef writer_stats detached_stats;
+#else
+struct detached_stats
+{
+};
+#endif
 
-template<typename InputIt>
-struct range
+// While alive, what the calling thread writes is counted apart from its
+// totals, as if nested in a container: used for output that is buffered,
+// and only counted as bytes once it reaches the sink
+class detached_instrumentation
 {
-    InputIt begin;
-    InputIt end;
+#if defined(MJW_ENABLE_INSTRUMENTATION)
+private:
+
+    writer_stats m_totals;
+    unsigned m_depth;
+    unsigned m_document_max_depth;
+
+    detached_instrumentation(const detached_instrumentation&);
+    detached_instrumentation& operator=(const detached_instrumentation&);
+
+public:
+
+    detached_instrumentation()
+    {
+        instrumentation_state& state = instrumentation();
+        m_totals = state.totals;
+        m_depth = state.depth;
+        m_document_max_depth = state.document_max_depth;
+        state.totals = writer_stats();
+        state.depth = 1;
+    }
+
+    ~detached_instrumentation()
+    {
+        instrumentation_state& state = instrumentation();
+        state.totals = m_totals;
+        state.depth = m_depth;
+        state.document_max_depth = m_document_max_depth;
+    }
+
+    // what has been counted so far
+    detached_stats stats() const
+    {
+        return instrumentation().totals;
+    }
+#else
+public:
+
+    detached_instrumentation()
+    {
+    }
+
+    detached_stats stats() const
+    {
+        return detached_stats();
+    }
+#endif
+};
+
+// Adds the values counted in a detached scope to the calling thread's
+// totals, nested in its current container; the bytes are left out
+template<typename Sink>
+void attach_instrumentation(const detached_stats& stats)
+{
+#if defined(MJW_ENABLE_INSTRUMENTATION)
+    if (is_counting_sink<Sink>::value)
+    {
+        return;
+    }
+    instrumentation_state& state = instrumentation();
+    writer_stats& totals = state.totals;
+    totals.integrals += stats.integrals;
+    totals.floating_points += stats.floating_points;
+    totals.strings += stats.strings;
+    totals.nulls += stats.nulls;
+    totals.booleans += stats.booleans;
+    totals.binaries += stats.binaries;
+    totals.custom_values += stats.custom_values;
+    totals.escapes += stats.escapes;
+
+    // the detached scope starts at depth 1
+    if (stats.max_depth > 1)
+    {
+        const unsigned depth = std::max(state.depth, 1U) + stats.max_depth - 1;
+        totals.max_depth = std::max(totals.max_depth, depth);
+        state.document_max_depth = std::max(state.document_max_depth, depth);
+    }
+#else
+    (void)stats;
+#endif
+}
+
+// All the output goes through these functions: a sink is any type exposing
+// put(char) and write(const char*, size), std::ostream included
+template<typename Sink>
+void put(Sink& sink, char c)
+{
+    count_bytes<Sink>(1);
+    sink.put(c);
+}
+
+template<typename Sink>
+void write(Sink& sink, const char* data, std::size_t size)
+{
+    count_bytes<Sink>(size);
+    sink.write(data, size);
+}
+
+inline void write(std::ostream& stream, const char* data, std::size_t size)
+{
+    count_bytes<std::ostream>(size);
+    stream.write(data, static_cast<std::streamsize>(size));
+}
+
+// Used by sinks handing their output on to another sink, so that it is only
+// counted once by the instrumentation
+template<typename Sink>
+void forward_put(Sink& sink, char c)
+{
+    sink.put(c);
+}
+
+template<typename Sink>
+void forward_write(Sink& sink, const char* data, std::size_t size)
+{
+    sink.write(data, size);
+}
+
+inline void forward_write(std::ostream& stream, const char* data, std::size_t size)
+{
+    stream.write(data, static_cast<std::streamsize>(size));
+}
+
+template<typename Sink>
+void write(Sink& sink, const char* str)
+{
+    write(sink, str, std::strlen(str));
+}
+
+// Sinks may also expose char* prepare(size), returning room for at least
+// size characters, and commit(size), so that values can be formatted in place
+template<typename Sink>
+void commit(Sink& sink, std::size_t size)
+{
+    count_bytes<Sink>(size);
+    sink.commit(size);
+}
+
+template<typename Sink>
+struct has_direct_access
+{
+    typedef char yes;
+    typedef char (&no)[2];
+
+    template<typename U, char* (U::*)(std::size_t)>
+    struct check;
+
+    template<typename U>
+    static yes test(check<U, &U::prepare>*);
+
+    template<typename U>
+    static no test(...);
+
+    static const bool value = sizeof(test<Sink>(NULL)) == sizeof(yes);
+};
+
+// Sinks may also expose write_external(data, size), keeping a reference to
+// data rather than copying it (see iovec_sink)
+template<typename Sink>
+struct has_external_write
+{
+    typedef char yes;
+    typedef char (&no)[2];
+
+    template<typename U, void (U::*)(const char*, std::size_t)>
+    struct check;
+
+    template<typename U>
+    static yes test(check<U, &U::write_external>*);
+
+    template<typename U>
+    static no test(...);
+
+    static const bool value = sizeof(test<Sink>(NULL)) == sizeof(yes);
+};
+
+template<typename T>
+struct always_void
+{
+    typedef void type;
 };
 
+template<typename Sink, typename Enable = void>
+struct sink_encoding
+{
+    typedef json_encoding type;
+};
+
+template<typename Sink>
+struct sink_encoding<Sink, typename always_void<typename Sink::encoding>::type>
+{
+    typedef typename Sink::encoding type;
+};
+
+template<typename Sink>
+struct is_json_sink
+{
+    static const bool value = MJW_LIB_NS::is_same<typename sink_encoding<Sink>::type, json_encoding>::value;
+};
+
+typedef MJW_LIB_NS::uint32_t uint32;
+typedef MJW_LIB_NS::uint64_t uint64;
+
 template<typename InputIt>
-range<InputIt> make_range(InputIt begin, InputIt end)
+struct get_value_type
 {
-    const range<InputIt> range = { begin, end };
+    typedef typename MJW_LIB_NS::remove_cv<typename std::iterator_traits<InputIt>::value_type>::type type;
+};
 
-    return range;
+// The ios_base::iword slot set by use_stream_precision
+inline int stream_precision_index()
+{
+    static const int index = std::ios_base::xalloc();
+
+    return index;
 }
 
-template<typename InputIt, typename ValueWriter>
-class range_writer
+namespace
 {
-private:
 
-    ValueWriter m_value_writer;
+template<typename Sink>
+typename enable_if<!is_ostream<Sink>::value>::type establish_stream_settings(Sink&)
+{
+    // only streams have settings to adjust
+}
 
-public:
+template<typename Sink>
+typename enable_if<!is_ostream<Sink>::value>::type restore_stream_flags(Sink&)
+{
+}
+
+// Called once per top-level document: imbuing is expensive, so it is skipped
+// when the stream already uses the classic locale
+template<typename Stream>
+typename enable_if<is_ostream<Stream>::value>::type establish_stream_settings(Stream& stream)
+{
+    if (stream.getloc() != std::locale::classic())
+    {
+        stream.imbue(std::locale::classic());
+    }
+    stream << std::resetiosflags(std::ios::showpoint | std::ios::showpos);
+    stream << std::dec << std::setw(0);
+}
+
+// Called before every write: the client may have altered the flags in the
+// meantime, but they are only reset when they actually differ
+template<typename Stream>
+typename enable_if<is_ostream<Stream>::value>::type restore_stream_flags(Stream& stream)
+{
+    const std::ios::fmtflags mask = std::ios::basefield | std::ios::showpoint | std::ios::showpos;
+
+    if ((stream.flags() & mask) != std::ios::dec || stream.width() != 0)
+    {
+        stream.setf(std::ios::dec, mask);
+        stream.width(0);
+    }
+}
+
+// For every byte, the character following the backslash in its escape
+// sequence ('u' for \u00XX), or 0 if the byte is written as is
+inline const char* escape_table()
+{
+    static const char table[256] =
+    {
+        'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 't', 'n', 'u', 'u', 'r', 'u', 'u', // 0x00
+        'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', // 0x10
+        0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,                             // 0x20
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,                               // 0x30
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,                               // 0x40
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,                            // 0x50
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,                               // 0x60
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 'u'                              // 0x70
+        // 0x80-0xff (UTF-8 sequences) are never escaped
+    };
+
+    return table;
+}
+
+inline bool needs_escape(char c)
+{
+    return escape_table()[static_cast<unsigned char>(c)] != 0;
+}
+
+inline unsigned count_trailing_zeros(unsigned mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+// Returns the first character in [begin, end) needing an escape, or end
+inline const char* find_escape(const char* begin, const char* end)
+{
+#if MJW_AVX2_SUPPORTED
+    const __m256i quote32 = _mm256_set1_epi8('"');
+    const __m256i backslash32 = _mm256_set1_epi8('\\');
+    const __m256i del32 = _mm256_set1_epi8(127);
+    const __m256i control32 = _mm256_set1_epi8(31);
+
+    while (end - begin >= 32)
+    {
+        const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+        const __m256i matches = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote32), _mm256_cmpeq_epi8(chunk, backslash32)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, del32), _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, control32), chunk)));
+
+        const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(matches));
+        if (mask != 0)
+        {
+            return begin + count_trailing_zeros(mask);
+        }
+        begin += 32;
+    }
+#endif
+
+#if MJW_SSE2_SUPPORTED
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i del = _mm_set1_epi8(127);
+    const __m128i control = _mm_set1_epi8(31);
+
+    while (end - begin >= 16)
+    {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+        // unsigned chunk <= 31 is detected as min(chunk, 31) == chunk
+        const __m128i matches = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, del), _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk)));
+
+        const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(matches));
+        if (mask != 0)
+        {
+            return begin + count_trailing_zeros(mask);
+        }
+        begin += 16;
+    }
+#endif
+
+    while (begin != end && !needs_escape(*begin))
+    {
+        begin++;
+    }
+
+    return begin;
+}
+
+template<typename Sink>
+void write_escape(Sink& sink, char c)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+
+    count_escape();
+
+    const char escaped = escape_table()[static_cast<unsigned char>(c)];
+    if (escaped == 'u')
+    {
+        const char escape[] =
+        {
+            '\\', 'u', '0', '0',
+            hex_digits[(c >> 4) & 0xf],
+            hex_digits[c & 0xf]
+        };
+        write(sink, escape, sizeof(escape));
+    }
+    else
+    {
+        const char escape[] = { '\\', escaped };
+        write(sink, escape, sizeof(escape));
+    }
+}
+
+template<typename Sink>
+void write_run(Sink& sink, const char* data, std::size_t size, MJW_LIB_NS::false_type)
+{
+    write(sink, data, size);
+}
+
+template<typename Sink>
+void write_run(Sink& sink, const char* data, std::size_t size, MJW_LIB_NS::true_type)
+{
+    count_bytes<Sink>(size);
+    sink.write_external(data, size);
+}
+
+// Runs of characters not needing an escape are copied in bulk, or handed to
+// the sink's write_external() when External is true_type
+template<typename Sink, typename External>
+typename enable_if<!is_counting_sink<Sink>::value>::type write_quoted_string(Sink& sink, const char* str, std::size_t length, External external)
+{
+    const char* const end = str + length;
+
+    put(sink, '"');
+
+    for (;;)
+    {
+        const char* const run_end = find_escape(str, end);
+        if (run_end != str)
+        {
+            write_run(sink, str, static_cast<std::size_t>(run_end - str), external);
+        }
+        if (run_end == end)
+        {
+            break;
+        }
+
+        write_escape(sink, *run_end);
+        str = run_end + 1;
+    }
+
+    put(sink, '"');
+}
+
+// Only adds up the length of the escaped string
+template<typename Sink, typename External>
+typename enable_if<is_counting_sink<Sink>::value>::type write_quoted_string(Sink& sink, const char* str, std::size_t length, External)
+{
+    const char* const end = str + length;
+    std::size_t size = length + 2;
+
+    for (const char* it = find_escape(str, end); it != end; it = find_escape(it + 1, end))
+    {
+        size += escape_table()[static_cast<unsigned char>(*it)] == 'u' ? 5 : 1;
+    }
+
+    sink.add(size);
+}
+
+template<typename Sink>
+void write_quoted_string(Sink& sink, const char* str, std::size_t length)
+{
+    write_quoted_string(sink, str, length, MJW_LIB_NS::false_type());
+}
+
+template<typename Sink>
+void write_quoted_string(Sink& sink, const char* str)
+{
+    write_quoted_string(sink, str, std::strlen(str));
+}
+
+template<typename IntegralType>
+typename enable_if<MJW_LIB_NS::is_signed<IntegralType>::value, bool>::type is_negative(IntegralType value)
+{
+    return value < 0;
+}
+
+template<typename IntegralType>
+typename enable_if<!MJW_LIB_NS::is_signed<IntegralType>::value, bool>::type is_negative(IntegralType)
+{
+    return false;
+}
+
+// enough room for the digits and the sign of any value of the type
+template<typename IntegralType>
+struct max_integral_length
+{
+    static const std::size_t value = std::numeric_limits<IntegralType>::digits10 + 2;
+};
+
+template<typename Unsigned>
+std::size_t count_digits(Unsigned value)
+{
+    // four digits per iteration, so that at most five divisions are needed for 64-bit values
+    std::size_t digits = 1;
+    for (;;)
+    {
+        if (value < 10) return digits;
+        if (value < 100) return digits + 1;
+        if (value < 1000) return digits + 2;
+        if (value < 10000) return digits + 3;
+        value /= 10000;
+        digits += 4;
+    }
+}
+
+// Writes the digits backwards, ending right before end
+template<typename Unsigned>
+void format_digits(char* end, Unsigned value)
+{
+    static const char digit_pairs[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+    while (value >= 100)
+    {
+        const std::size_t index = static_cast<std::size_t>(value % 100) * 2;
+        value /= 100;
+        *--end = digit_pairs[index + 1];
+        *--end = digit_pairs[index];
+    }
+
+    if (value >= 10)
+    {
+        const std::size_t index = static_cast<std::size_t>(value) * 2;
+        *--end = digit_pairs[index + 1];
+        *--end = digit_pairs[index];
+    }
+    else
+    {
+        *--end = static_cast<char>('0' + value);
+    }
+}
+
+// Negating in the unsigned domain keeps the most negative value valid
+template<typename IntegralType>
+typename MJW_LIB_NS::make_unsigned<IntegralType>::type absolute_value(IntegralType value)
+{
+    typename MJW_LIB_NS::make_unsigned<IntegralType>::type magnitude = value;
+    if (is_negative(value))
+    {
+        magnitude = 0 - magnitude;
+    }
+    return magnitude;
+}
+
+// Formats value into dest, which must have room for max_integral_length
+// characters, and returns the number of characters written
+template<typename IntegralType>
+std::size_t format_integral(char* dest, IntegralType value)
+{
+    const bool negative = is_negative(value);
+    const typename MJW_LIB_NS::make_unsigned<IntegralType>::type magnitude = absolute_value(value);
+    if (negative)
+    {
+        *dest++ = '-';
+    }
+
+    const std::size_t digits = count_digits(magnitude);
+    format_digits(dest + digits, magnitude);
+
+    return digits + negative;
+}
+
+template<typename Sink, typename IntegralType>
+typename enable_if<has_direct_access<Sink>::value>::type write_integral(Sink& sink, IntegralType value)
+{
+    char* const dest = sink.prepare(max_integral_length<IntegralType>::value);
+    commit(sink, format_integral(dest, value));
+}
+
+// Only adds up the length of the number
+template<typename Sink, typename IntegralType>
+typename enable_if<is_counting_sink<Sink>::value>::type write_integral(Sink& sink, IntegralType value)
+{
+    sink.add(is_negative(value) + count_digits(absolute_value(value)));
+}
+
+template<typename Sink, typename IntegralType>
+typename enable_if<!has_direct_access<Sink>::value && !is_counting_sink<Sink>::value>::type write_integral(Sink& sink, IntegralType value)
+{
+    char buffer[max_integral_length<IntegralType>::value];
+    write(sink, buffer, format_integral(buffer, value));
+}
+
+// Shortest round-trip formatting of floating-point values, based on the
+// Grisu2 algorithm by Florian Loitsch ("Printing Floating-Point Numbers
+// Quickly and Accurately with Integers", PLDI 2010)
+
+struct diy_fp
+{
+    uint64 f;
+    int e;
+
+    diy_fp(uint64 f, int e) : f(f), e(e)
+    {
+    }
+
+    // x and y must have the same exponent, and x.f >= y.f
+    static diy_fp sub(const diy_fp& x, const diy_fp& y)
+    {
+        return diy_fp(x.f - y.f, x.e);
+    }
+
+    // the upper 64 bits of the 128-bit product, rounded
+    static diy_fp mul(const diy_fp& x, const diy_fp& y)
+    {
+        const uint64 u_lo = x.f & 0xFFFFFFFFu;
+        const uint64 u_hi = x.f >> 32;
+        const uint64 v_lo = y.f & 0xFFFFFFFFu;
+        const uint64 v_hi = y.f >> 32;
+
+        const uint64 p0 = u_lo * v_lo;
+        const uint64 p1 = u_lo * v_hi;
+        const uint64 p2 = u_hi * v_lo;
+        const uint64 p3 = u_hi * v_hi;
+
+        uint64 q = (p0 >> 32) + (p1 & 0xFFFFFFFFu) + (p2 & 0xFFFFFFFFu);
+        q += uint64(1) << 31; // rounding
+
+        return diy_fp(p3 + (p1 >> 32) + (p2 >> 32) + (q >> 32), x.e + y.e + 64);
+    }
+
+    static diy_fp normalize(diy_fp x)
+    {
+        while ((x.f >> 63) == 0)
+        {
+            x.f <<= 1;
+            x.e--;
+        }
+        return x;
+    }
+
+    static diy_fp normalize_to(const diy_fp& x, int target_exponent)
+    {
+        return diy_fp(x.f << (x.e - target_exponent), target_exponent);
+    }
+};
+
+struct fp_boundaries
+{
+    diy_fp w;
+    diy_fp minus;
+    diy_fp plus;
+
+    fp_boundaries(const diy_fp& w, const diy_fp& minus, const diy_fp& plus) : w(w), minus(minus), plus(plus)
+    {
+    }
+};
+
+template<typename FloatingPoint>
+struct fp_bits;
+
+template<>
+struct fp_bits<float>
+{
+    typedef uint32 type;
+};
+
+template<>
+struct fp_bits<double>
+{
+    typedef uint64 type;
+};
+
+// Computes the normalized value and its normalized boundaries m- and m+,
+// halfway between value and its neighbours; value must be finite and positive
+template<typename FloatingPoint>
+fp_boundaries compute_boundaries(FloatingPoint value)
+{
+    const int precision = std::numeric_limits<FloatingPoint>::digits; // including the hidden bit
+    const int bias = std::numeric_limits<FloatingPoint>::max_exponent - 1 + (precision - 1);
+    const int min_exponent = 1 - bias;
+    const uint64 hidden_bit = uint64(1) << (precision - 1);
+
+    typename fp_bits<FloatingPoint>::type bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+
+    const uint64 fraction = bits & (hidden_bit - 1);
+    const int exponent = static_cast<int>(bits >> (precision - 1));
+
+    const diy_fp v = exponent == 0
+        ? diy_fp(fraction, min_exponent) // subnormal
+        : diy_fp(fraction + hidden_bit, exponent - bias);
+
+    // the lower boundary is closer when value is a power of two
+    const bool lower_boundary_is_closer = fraction == 0 && exponent > 1;
+    const diy_fp plus(2 * v.f + 1, v.e - 1);
+    const diy_fp minus = lower_boundary_is_closer
+        ? diy_fp(4 * v.f - 1, v.e - 2)
+        : diy_fp(2 * v.f - 1, v.e - 1);
+
+    const diy_fp normalized_plus = diy_fp::normalize(plus);
+
+    return fp_boundaries(
+        diy_fp::normalize(v),
+        diy_fp::normalize_to(minus, normalized_plus.e),
+        normalized_plus);
+}
+
+struct cached_power
+{
+    uint64 f;
+    int e;
+    int k;
+};
+
+// Returns c = 10^k such that alpha <= c.e + e + 64 <= gamma
+inline cached_power get_cached_power(int e)
+{
+    static const int alpha = -60;
+    static const int min_decimal_exponent = -300;
+    static const int decimal_exponent_step = 8;
+
+    // normalized 10^k for k = -300, -292, ..., 324
+    static const cached_power cached_powers[] =
+    {
+        { 0xAB70FE17C79AC6CAULL, -1060, -300 },
+        { 0xFF77B1FCBEBCDC4FULL, -1034, -292 },
+        { 0xBE5691EF416BD60CULL, -1007, -284 },
+        { 0x8DD01FAD907FFC3CULL,  -980, -276 },
+        { 0xD3515C2831559A83ULL,  -954, -268 },
+        { 0x9D71AC8FADA6C9B5ULL,  -927, -260 },
+        { 0xEA9C227723EE8BCBULL,  -901, -252 },
+        { 0xAECC49914078536DULL,  -874, -244 },
+        { 0x823C12795DB6CE57ULL,  -847, -236 },
+        { 0xC21094364DFB5637ULL,  -821, -228 },
+        { 0x9096EA6F3848984FULL,  -794, -220 },
+        { 0xD77485CB25823AC7ULL,  -768, -212 },
+        { 0xA086CFCD97BF97F4ULL,  -741, -204 },
+        { 0xEF340A98172AACE5ULL,  -715, -196 },
+        { 0xB23867FB2A35B28EULL,  -688, -188 },
+        { 0x84C8D4DFD2C63F3BULL,  -661, -180 },
+        { 0xC5DD44271AD3CDBAULL,  -635, -172 },
+        { 0x936B9FCEBB25C996ULL,  -608, -164 },
+        { 0xDBAC6C247D62A584ULL,  -582, -156 },
+        { 0xA3AB66580D5FDAF6ULL,  -555, -148 },
+        { 0xF3E2F893DEC3F126ULL,  -529, -140 },
+        { 0xB5B5ADA8AAFF80B8ULL,  -502, -132 },
+        { 0x87625F056C7C4A8BULL,  -475, -124 },
+        { 0xC9BCFF6034C13053ULL,  -449, -116 },
+        { 0x964E858C91BA2655ULL,  -422, -108 },
+        { 0xDFF9772470297EBDULL,  -396, -100 },
+        { 0xA6DFBD9FB8E5B88FULL,  -369,  -92 },
+        { 0xF8A95FCF88747D94ULL,  -343,  -84 },
+        { 0xB94470938FA89BCFULL,  -316,  -76 },
+        { 0x8A08F0F8BF0F156BULL,  -289,  -68 },
+        { 0xCDB02555653131B6ULL,  -263,  -60 },
+        { 0x993FE2C6D07B7FACULL,  -236,  -52 },
+        { 0xE45C10C42A2B3B06ULL,  -210,  -44 },
+        { 0xAA242499697392D3ULL,  -183,  -36 },
+        { 0xFD87B5F28300CA0EULL,  -157,  -28 },
+        { 0xBCE5086492111AEBULL,  -130,  -20 },
+        { 0x8CBCCC096F5088CCULL,  -103,  -12 },
+        { 0xD1B71758E219652CULL,   -77,   -4 },
+        { 0x9C40000000000000ULL,   -50,    4 },
+        { 0xE8D4A51000000000ULL,   -24,   12 },
+        { 0xAD78EBC5AC620000ULL,     3,   20 },
+        { 0x813F3978F8940984ULL,    30,   28 },
+        { 0xC097CE7BC90715B3ULL,    56,   36 },
+        { 0x8F7E32CE7BEA5C70ULL,    83,   44 },
+        { 0xD5D238A4ABE98068ULL,   109,   52 },
+        { 0x9F4F2726179A2245ULL,   136,   60 },
+        { 0xED63A231D4C4FB27ULL,   162,   68 },
+        { 0xB0DE65388CC8ADA8ULL,   189,   76 },
+        { 0x83C7088E1AAB65DBULL,   216,   84 },
+        { 0xC45D1DF942711D9AULL,   242,   92 },
+        { 0x924D692CA61BE758ULL,   269,  100 },
+        { 0xDA01EE641A708DEAULL,   295,  108 },
+        { 0xA26DA3999AEF774AULL,   322,  116 },
+        { 0xF209787BB47D6B85ULL,   348,  124 },
+        { 0xB454E4A179DD1877ULL,   375,  132 },
+        { 0x865B86925B9BC5C2ULL,   402,  140 },
+        { 0xC83553C5C8965D3DULL,   428,  148 },
+        { 0x952AB45CFA97A0B3ULL,   455,  156 },
+        { 0xDE469FBD99A05FE3ULL,   481,  164 },
+        { 0xA59BC234DB398C25ULL,   508,  172 },
+        { 0xF6C69A72A3989F5CULL,   534,  180 },
+        { 0xB7DCBF5354E9BECEULL,   561,  188 },
+        { 0x88FCF317F22241E2ULL,   588,  196 },
+        { 0xCC20CE9BD35C78A5ULL,   614,  204 },
+        { 0x98165AF37B2153DFULL,   641,  212 },
+        { 0xE2A0B5DC971F303AULL,   667,  220 },
+        { 0xA8D9D1535CE3B396ULL,   694,  228 },
+        { 0xFB9B7CD9A4A7443CULL,   720,  236 },
+        { 0xBB764C4CA7A44410ULL,   747,  244 },
+        { 0x8BAB8EEFB6409C1AULL,   774,  252 },
+        { 0xD01FEF10A657842CULL,   800,  260 },
+        { 0x9B10A4E5E9913129ULL,   827,  268 },
+        { 0xE7109BFBA19C0C9DULL,   853,  276 },
+        { 0xAC2820D9623BF429ULL,   880,  284 },
+        { 0x80444B5E7AA7CF85ULL,   907,  292 },
+        { 0xBF21E44003ACDD2DULL,   933,  300 },
+        { 0x8E679C2F5E44FF8FULL,   960,  308 },
+        { 0xD433179D9C8CB841ULL,   986,  316 },
+        { 0x9E19DB92B4E31BA9ULL,  1013,  324 },
+    };
+
+    // ceil(log10(2^(alpha - e - 1)))
+    const int f = alpha - e - 1;
+    const int k = (f * 78913) / (1 << 18) + (f > 0);
+
+    const int index = (-min_decimal_exponent + k + (decimal_exponent_step - 1)) / decimal_exponent_step;
+
+    return cached_powers[index];
+}
+
+// For n != 0, returns k such that pow10 = 10^(k - 1) <= n < 10^k
+inline int find_largest_pow10(uint32 n, uint32& pow10)
+{
+    if (n >= 1000000000) { pow10 = 1000000000; return 10; }
+    if (n >= 100000000) { pow10 = 100000000; return 9; }
+    if (n >= 10000000) { pow10 = 10000000; return 8; }
+    if (n >= 1000000) { pow10 = 1000000; return 7; }
+    if (n >= 100000) { pow10 = 100000; return 6; }
+    if (n >= 10000) { pow10 = 10000; return 5; }
+    if (n >= 1000) { pow10 = 1000; return 4; }
+    if (n >= 100) { pow10 = 100; return 3; }
+    if (n >= 10) { pow10 = 10; return 2; }
+    pow10 = 1;
+    return 1;
+}
+
+inline void grisu2_round(char* buffer, int length, uint64 dist, uint64 delta, uint64 rest, uint64 ten_k)
+{
+    // move the last digit towards w as long as the result stays within
+    // the rounding interval and gets closer to w
+    while (rest < dist && delta - rest >= ten_k && (rest + ten_k < dist || dist - rest > rest + ten_k - dist))
+    {
+        buffer[length - 1]--;
+        rest += ten_k;
+    }
+}
+
+// Generates the shortest digits of a number in the interval (M-, M+),
+// closest to w; the value is digits * 10^decimal_exponent
+inline void grisu2_digit_gen(char* buffer, int& length, int& decimal_exponent, const diy_fp& m_minus, const diy_fp& w, const diy_fp& m_plus)
+{
+    uint64 delta = diy_fp::sub(m_plus, m_minus).f;
+    uint64 dist = diy_fp::sub(m_plus, w).f;
+
+    // split M+ into an integral part p1 and a fractional part p2
+    const diy_fp one(uint64(1) << -m_plus.e, m_plus.e);
+
+    uint32 p1 = static_cast<uint32>(m_plus.f >> -one.e);
+    uint64 p2 = m_plus.f & (one.f - 1);
+
+    uint32 pow10;
+    int n = find_largest_pow10(p1, pow10);
+
+    while (n > 0)
+    {
+        const uint32 digit = p1 / pow10;
+        p1 %= pow10;
+        buffer[length++] = static_cast<char>('0' + digit);
+        n--;
+
+        const uint64 rest = (uint64(p1) << -one.e) + p2;
+        if (rest <= delta)
+        {
+            decimal_exponent += n;
+            grisu2_round(buffer, length, dist, delta, rest, uint64(pow10) << -one.e);
+            return;
+        }
+
+        pow10 /= 10;
+    }
+
+    int m = 0;
+    for (;;)
+    {
+        p2 *= 10;
+        delta *= 10;
+        dist *= 10;
+
+        const uint64 digit = p2 >> -one.e;
+        p2 &= one.f - 1;
+        buffer[length++] = static_cast<char>('0' + digit);
+        m++;
+
+        if (p2 <= delta)
+        {
+            break;
+        }
+    }
+
+    decimal_exponent -= m;
+    grisu2_round(buffer, length, dist, delta, p2, one.f);
+}
+
+// value must be finite and positive
+template<typename FloatingPoint>
+void grisu2(char* buffer, int& length, int& decimal_exponent, FloatingPoint value)
+{
+    const fp_boundaries boundaries = compute_boundaries(value);
+
+    const cached_power cached = get_cached_power(boundaries.plus.e);
+    const diy_fp c_minus_k(cached.f, cached.e);
+
+    const diy_fp w = diy_fp::mul(boundaries.w, c_minus_k);
+    const diy_fp w_minus = diy_fp::mul(boundaries.minus, c_minus_k);
+    const diy_fp w_plus = diy_fp::mul(boundaries.plus, c_minus_k);
+
+    // shrink the interval by one unit to account for the rounding errors
+    const diy_fp m_minus(w_minus.f + 1, w_minus.e);
+    const diy_fp m_plus(w_plus.f - 1, w_plus.e);
+
+    length = 0;
+    decimal_exponent = -cached.k;
+    grisu2_digit_gen(buffer, length, decimal_exponent, m_minus, w, m_plus);
+}
+
+// Lays out the digits of digits * 10^decimal_exponent in place: plain
+// notation is used for 1e-4 <= |value| < 1e17, scientific otherwise
+inline int format_shortest(char* buffer, int length, int decimal_exponent)
+{
+    const int n = length + decimal_exponent; // position of the decimal point
+
+    if (length <= n && n <= 17)
+    {
+        // 123400
+        std::memset(buffer + length, '0', static_cast<std::size_t>(n - length));
+        return n;
+    }
+
+    if (0 < n && n <= 17)
+    {
+        // 12.34
+        std::memmove(buffer + n + 1, buffer + n, static_cast<std::size_t>(length - n));
+        buffer[n] = '.';
+        return length + 1;
+    }
+
+    if (-4 < n && n <= 0)
+    {
+        // 0.001234
+        std::memmove(buffer + 2 - n, buffer, static_cast<std::size_t>(length));
+        buffer[0] = '0';
+        buffer[1] = '.';
+        std::memset(buffer + 2, '0', static_cast<std::size_t>(-n));
+        return 2 - n + length;
+    }
+
+    // 1.234e+56, with at least two exponent digits
+    int size = length;
+    if (length > 1)
+    {
+        std::memmove(buffer + 2, buffer + 1, static_cast<std::size_t>(length - 1));
+        buffer[1] = '.';
+        size++;
+    }
+
+    int exponent = n - 1;
+    buffer[size++] = 'e';
+    if (exponent < 0)
+    {
+        buffer[size++] = '-';
+        exponent = -exponent;
+    }
+    else
+    {
+        buffer[size++] = '+';
+    }
+
+    if (exponent >= 100)
+    {
+        buffer[size++] = static_cast<char>('0' + exponent / 100);
+        exponent %= 100;
+    }
+    buffer[size++] = static_cast<char>('0' + exponent / 10);
+    buffer[size++] = static_cast<char>('0' + exponent % 10);
+
+    return size;
+}
+
+// enough room for the sign, the digits, the decimal point and the padding
+// or the exponent of the longest representation (quadruple precision long
+// double needs up to 36 digits)
+const std::size_t max_floating_point_length = 48;
+
+// Formats a finite value into dest, which must have room for
+// max_floating_point_length characters, and returns the number of
+// characters written
+template<typename FloatingPoint>
+std::size_t format_floating_point(char* dest, FloatingPoint value)
+{
+    char* const begin = dest;
+
+    if (MJW_SIGNBIT(value))
+    {
+        *dest++ = '-';
+        value = -value;
+    }
+
+    if (value == 0)
+    {
+        *dest++ = '0';
+        return static_cast<std::size_t>(dest - begin);
+    }
+
+    int length;
+    int decimal_exponent;
+    grisu2(dest, length, decimal_exponent, value);
+
+    return static_cast<std::size_t>(dest - begin) + format_shortest(dest, length, decimal_exponent);
+}
+
+// Grisu2 only handles the IEEE binary formats: long double values that are
+// exactly representable as double are written as such, the others with
+// enough digits to round-trip
+inline std::size_t format_floating_point(char* dest, long double value)
+{
+    if (static_cast<long double>(static_cast<double>(value)) == value)
+    {
+        return format_floating_point(dest, static_cast<double>(value));
+    }
+
+    const int length = std::sprintf(dest, "%.*Lg", std::numeric_limits<long double>::digits10 + 3, value);
+
+    // the decimal point depends on the C locale, and may be longer than one
+    // character: the exponent and the digits are left alone
+    const char* const decimal_point = std::localeconv()->decimal_point;
+    const std::size_t decimal_point_length = std::strlen(decimal_point);
+    char* const found = decimal_point_length != 0 ? std::strstr(dest, decimal_point) : NULL;
+    if (found == NULL)
+    {
+        return static_cast<std::size_t>(length);
+    }
+
+    *found = '.';
+    const std::size_t tail = static_cast<std::size_t>(dest + length - found) - decimal_point_length;
+    std::memmove(found + 1, found + decimal_point_length, tail);
+
+    return static_cast<std::size_t>(length) - (decimal_point_length - 1);
+}
+
+template<typename Sink, typename FloatingPoint>
+typename enable_if<has_direct_access<Sink>::value>::type write_shortest(Sink& sink, FloatingPoint value)
+{
+    char* const dest = sink.prepare(max_floating_point_length);
+    commit(sink, format_floating_point(dest, value));
+}
+
+template<typename Sink, typename FloatingPoint>
+typename enable_if<!has_direct_access<Sink>::value>::type write_shortest(Sink& sink, FloatingPoint value)
+{
+    char buffer[max_floating_point_length];
+    write(sink, buffer, format_floating_point(buffer, value));
+}
+
+// std::fixed, std::scientific and std::setprecision are honoured; otherwise
+// the shortest representation that round-trips is written. A precision of 6
+// cannot be told apart from the default one, and is only honoured after
+// use_stream_precision
+template<typename Stream>
+typename enable_if<is_ostream<Stream>::value, bool>::type uses_shortest_format(Stream& stream)
+{
+    return (stream.flags() & std::ios::floatfield) == 0 && stream.precision() == 6 &&
+        stream.iword(stream_precision_index()) == 0;
+}
+
+template<typename Sink>
+typename enable_if<!is_ostream<Sink>::value, bool>::type uses_shortest_format(const Sink&)
+{
+    return true;
+}
+
+template<typename Stream, typename FloatingPoint>
+typename enable_if<is_ostream<Stream>::value>::type write_floating_point(Stream& stream, FloatingPoint value)
+{
+    if (uses_shortest_format(stream))
+    {
+        write_shortest(stream, value);
+    }
+    else
+    {
+        // the locale is only established once per document: the client may
+        // have imbued another one since
+        if (stream.getloc() != std::locale::classic())
+        {
+            stream.imbue(std::locale::classic());
+        }
+        stream << value;
+    }
+}
+
+template<typename Sink, typename FloatingPoint>
+typename enable_if<!is_ostream<Sink>::value>::type write_floating_point(Sink& sink, FloatingPoint value)
+{
+    write_shortest(sink, value);
+}
+
+} // unnamed namespace
+
+template<typename InputIt>
+struct range
+{
+    InputIt begin;
+    InputIt end;
+};
+
+template<typename InputIt>
+range<InputIt> make_range(InputIt begin, InputIt end)
+{
+    const range<InputIt> range = { begin, end };
+
+    return range;
+}
+
+template<typename InputIt, typename ValueWriter>
+class range_writer
+{
+private:
+
+    ValueWriter m_value_writer;
+
+public:
+
+    explicit range_writer(ValueWriter value_writer) :
+        m_value_writer(value_writer)
+    {
+    }
+
+    template<typename Sink>
+    void operator()(Sink& sink, const range<InputIt>& range) const
+    {
+        write_array(sink, range.begin, range.end, m_value_writer);
+    }
+};
+
+} // namespace detail
+
+// Stream manipulators: after use_stream_precision, the stream's precision is
+// honoured even when it equals the default of 6
+inline std::ios_base& use_stream_precision(std::ios_base& stream)
+{
+    stream.iword(detail::stream_precision_index()) = 1;
+
+    return stream;
+}
+
+inline std::ios_base& use_default_precision(std::ios_base& stream)
+{
+    stream.iword(detail::stream_precision_index()) = 0;
+
+    return stream;
+}
+
+// A non-owning reference to a string of known length, which may contain NULs
+class string_ref
+{
+private:
+
+    const char* m_data;
+    std::size_t m_size;
+
+public:
+
+    string_ref(const char* str) :
+        m_data(str),
+        m_size(std::strlen(str))
+    {
+    }
+
+    string_ref(const char* data, std::size_t size) :
+        m_data(data),
+        m_size(size)
+    {
+    }
+
+    string_ref(const std::string& str) :
+        m_data(str.data()),
+        m_size(str.size())
+    {
+    }
+
+#if MJW_CPP17_SUPPORTED
+    string_ref(std::string_view str) :
+        m_data(str.data()),
+        m_size(str.size())
+    {
+    }
+#endif
+
+    const char* data() const
+    {
+        return m_data;
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+};
+
+// A string whose clean runs may be referenced, rather than copied, by sinks
+// exposing write_external() (see iovec_sink); other sinks copy it as usual
+class external_string : public string_ref
+{
+public:
+
+    external_string(const char* str) :
+        string_ref(str)
+    {
+    }
+
+    external_string(const char* data, std::size_t size) :
+        string_ref(data, size)
+    {
+    }
+
+    external_string(const std::string& str) :
+        string_ref(str)
+    {
+    }
+
+#if MJW_CPP17_SUPPORTED
+    external_string(std::string_view str) :
+        string_ref(str)
+    {
+    }
+#endif
+};
+
+// Already serialised JSON, written verbatim: the caller is responsible for
+// its validity
+class raw_json : public string_ref
+{
+public:
+
+    raw_json(const char* str) :
+        string_ref(str)
+    {
+    }
+
+    raw_json(const char* data, std::size_t size) :
+        string_ref(data, size)
+    {
+    }
+
+    raw_json(const std::string& str) :
+        string_ref(str)
+    {
+    }
+
+#if MJW_CPP17_SUPPORTED
+    raw_json(std::string_view str) :
+        string_ref(str)
+    {
+    }
+#endif
+};
+
+enum base64_alphabet
+{
+    BASE64_STANDARD, // A-Z a-z 0-9 + /, padded with '='
+    BASE64_URL       // A-Z a-z 0-9 - _, not padded (RFC 4648, section 5)
+};
+
+// Binary data: written as a base64 string in JSON, and as a byte string in
+// CBOR and MessagePack. The data is not copied.
+class binary_ref
+{
+private:
+
+    const unsigned char* m_data;
+    std::size_t m_size;
+    base64_alphabet m_alphabet;
+
+public:
+
+    binary_ref(const void* data, std::size_t size, base64_alphabet alphabet = BASE64_STANDARD) :
+        m_data(static_cast<const unsigned char*>(data)),
+        m_size(size),
+        m_alphabet(alphabet)
+    {
+    }
+
+    const unsigned char* data() const
+    {
+        return m_data;
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    base64_alphabet alphabet() const
+    {
+        return m_alphabet;
+    }
+};
+
+namespace detail
+{
+
+// Room for size characters: reserved in the sink when it has direct access,
+// or the local buffer otherwise
+template<typename Sink>
+typename enable_if<has_direct_access<Sink>::value, char*>::type begin_block(Sink& sink, std::size_t size, char*)
+{
+    return sink.prepare(size);
+}
+
+template<typename Sink>
+typename enable_if<!has_direct_access<Sink>::value, char*>::type begin_block(Sink&, std::size_t, char* buffer)
+{
+    return buffer;
+}
+
+template<typename Sink>
+typename enable_if<has_direct_access<Sink>::value>::type end_block(Sink& sink, const char*, std::size_t size)
+{
+    commit(sink, size);
+}
+
+template<typename Sink>
+typename enable_if<!has_direct_access<Sink>::value>::type end_block(Sink& sink, const char* block, std::size_t size)
+{
+    write(sink, block, size);
+}
+
+inline const char* base64_table(base64_alphabet alphabet)
+{
+    return alphabet == BASE64_URL ?
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_" :
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+}
+
+inline std::size_t base64_length(std::size_t size, base64_alphabet alphabet)
+{
+    if (alphabet == BASE64_URL)
+    {
+        return size / 3 * 4 + (size % 3 == 0 ? 0 : size % 3 + 1);
+    }
+    return (size + 2) / 3 * 4;
+}
+
+// Encodes size bytes, a multiple of 3, and returns the end of the output.
+// With SSSE3, 12 bytes are encoded at a time (Wojciech Muła's method):
+// the bytes are spread to one 6-bit index per output byte with pshufb and
+// multiplications, then the indices are mapped to characters by adding an
+// offset looked up with pshufb.
+inline char* encode_base64(char* dest, const unsigned char* src, std::size_t size, base64_alphabet alphabet)
+{
+#if MJW_SSSE3_SUPPORTED
+    const __m128i offsets = alphabet == BASE64_URL ?
+        _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '-' - 62, '_' - 63, 'A', 0, 0) :
+        _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+    // 16 bytes are loaded: the last 4 are only read
+    while (size >= 16)
+    {
+        __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        input = _mm_shuffle_epi8(input, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+        const __m128i high = _mm_mulhi_epu16(_mm_and_si128(input, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+        const __m128i low = _mm_mullo_epi16(_mm_and_si128(input, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+        const __m128i indices = _mm_or_si128(high, low);
+
+        // 0-25 -> 13, 26-51 -> 0, 52-61 -> 1-10, 62 -> 11, 63 -> 12
+        __m128i offset_index = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+        const __m128i uppercase = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+        offset_index = _mm_or_si128(offset_index, _mm_and_si128(uppercase, _mm_set1_epi8(13)));
+
+        const __m128i characters = _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, offset_index));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), characters);
+
+        src += 12;
+        size -= 12;
+        dest += 16;
+    }
+#endif
+
+    const char* const table = base64_table(alphabet);
+    for (; size >= 3; size -= 3)
+    {
+        const uint32 bits = (uint32(src[0]) << 16) | (uint32(src[1]) << 8) | src[2];
+        dest[0] = table[bits >> 18];
+        dest[1] = table[(bits >> 12) & 0x3f];
+        dest[2] = table[(bits >> 6) & 0x3f];
+        dest[3] = table[bits & 0x3f];
+        src += 3;
+        dest += 4;
+    }
+
+    return dest;
+}
+
+// The last 1 or 2 bytes
+inline std::size_t encode_base64_tail(char* dest, const unsigned char* src, std::size_t size, base64_alphabet alphabet)
+{
+    const char* const table = base64_table(alphabet);
+    const uint32 bits = (uint32(src[0]) << 16) | (size > 1 ? uint32(src[1]) << 8 : 0);
+
+    dest[0] = table[bits >> 18];
+    dest[1] = table[(bits >> 12) & 0x3f];
+    dest[2] = size > 1 ? table[(bits >> 6) & 0x3f] : '=';
+    dest[3] = '=';
+
+    return alphabet == BASE64_URL ? size + 1 : 4;
+}
+
+// Encodes straight into the sink, a block at a time: base64 never needs
+// escaping
+template<typename Sink>
+typename enable_if<!is_counting_sink<Sink>::value>::type write_base64(Sink& sink, const unsigned char* data, std::size_t size, base64_alphabet alphabet)
+{
+    const std::size_t block_size = 768; // input bytes, encoded as 1024 characters
+    char buffer[block_size / 3 * 4];
+
+    put(sink, '"');
+
+    while (size >= 3)
+    {
+        const std::size_t count = std::min(size - size % 3, block_size);
+        char* const block = begin_block(sink, count / 3 * 4, buffer);
+        encode_base64(block, data, count, alphabet);
+        end_block(sink, block, count / 3 * 4);
+        data += count;
+        size -= count;
+    }
+
+    if (size > 0)
+    {
+        char tail[4];
+        write(sink, tail, encode_base64_tail(tail, data, size, alphabet));
+    }
+
+    put(sink, '"');
+}
+
+template<typename Sink>
+typename enable_if<is_counting_sink<Sink>::value>::type write_base64(Sink& sink, const unsigned char*, std::size_t size, base64_alphabet alphabet)
+{
+    sink.add(2 + base64_length(size, alphabet));
+}
+
+} // namespace detail
+
+class buffer_sink
+{
+private:
+
+    char* m_begin;
+    char* m_end;
+    char* m_capacity_end;
+
+    // not copyable
+    buffer_sink(const buffer_sink&);
+    buffer_sink& operator=(const buffer_sink&);
+
+    void grow(std::size_t min_extra)
+    {
+        const std::size_t size = this->size();
+        std::size_t new_capacity = capacity() * 2;
+        if (new_capacity < size + min_extra)
+        {
+            new_capacity = size + min_extra;
+        }
+        if (new_capacity < 64)
+        {
+            new_capacity = 64;
+        }
+
+        char* const new_begin = new char[new_capacity];
+        if (size > 0)
+        {
+            std::memcpy(new_begin, m_begin, size);
+        }
+        delete[] m_begin;
+
+        m_begin = new_begin;
+        m_end = new_begin + size;
+        m_capacity_end = new_begin + new_capacity;
+    }
+
+public:
+
+    explicit buffer_sink(std::size_t initial_capacity = 0) :
+        m_begin(NULL),
+        m_end(NULL),
+        m_capacity_end(NULL)
+    {
+        reserve(initial_capacity);
+    }
+
+    ~buffer_sink()
+    {
+        delete[] m_begin;
+    }
+
+    void put(char c)
+    {
+        if (m_end == m_capacity_end)
+        {
+            grow(1);
+        }
+        *m_end++ = c;
+    }
+
+    void write(const char* data, std::size_t size)
+    {
+        if (size > static_cast<std::size_t>(m_capacity_end - m_end))
+        {
+            grow(size);
+        }
+        if (size > 0)
+        {
+            std::memcpy(m_end, data, size);
+            m_end += size;
+        }
+    }
+
+    char* prepare(std::size_t size)
+    {
+        if (size > static_cast<std::size_t>(m_capacity_end - m_end))
+        {
+            grow(size);
+        }
+        return m_end;
+    }
+
+    void commit(std::size_t size)
+    {
+        m_end += size;
+    }
+
+    void reserve(std::size_t capacity)
+    {
+        if (capacity > this->capacity())
+        {
+            grow(capacity - size());
+        }
+    }
+
+    // keeps the allocated memory for reuse
+    void clear()
+    {
+        m_end = m_begin;
+    }
+
+    char* data()
+    {
+        return m_begin;
+    }
+
+    const char* data() const
+    {
+        return m_begin;
+    }
+
+    std::size_t size() const
+    {
+        return static_cast<std::size_t>(m_end - m_begin);
+    }
+
+    std::size_t capacity() const
+    {
+        return static_cast<std::size_t>(m_capacity_end - m_begin);
+    }
+
+    std::string str() const
+    {
+        return std::string(m_begin, size());
+    }
+
+    void swap(buffer_sink& other)
+    {
+        std::swap(m_begin, other.m_begin);
+        std::swap(m_end, other.m_end);
+        std::swap(m_capacity_end, other.m_capacity_end);
+    }
+};
+
+// A pool of buffer_sinks, handed out by buffer_pool::handle and cleared
+// rather than freed when the handle is destroyed. The largest message seen
+// (the high-water mark) is tracked, and buffers are grown to it when they
+// are returned, so that in steady state no allocations happen. Not
+// thread-safe: on C++11, local() returns a pool per thread.
+class buffer_pool
+{
+private:
+
+    std::vector<buffer_sink*> m_free;
+    std::size_t m_initial_capacity;
+    std::size_t m_max_pooled;
+    std::size_t m_high_water;
+
+    // not copyable
+    buffer_pool(const buffer_pool&);
+    buffer_pool& operator=(const buffer_pool&);
+
+public:
+
+    class handle;
+
+    // at most max_pooled buffers are kept; the others are freed when returned
+    explicit buffer_pool(std::size_t initial_capacity = 4096, std::size_t max_pooled = 16) :
+        m_initial_capacity(initial_capacity),
+        m_max_pooled(max_pooled),
+        m_high_water(0)
+    {
+    }
+
+    // all the handles must have been destroyed
+    ~buffer_pool()
+    {
+        for (std::size_t i = 0; i < m_free.size(); i++)
+        {
+            delete m_free[i];
+        }
+    }
+
+    buffer_sink* acquire()
+    {
+        if (m_free.empty())
+        {
+            return new buffer_sink(std::max(m_initial_capacity, m_high_water));
+        }
+
+        buffer_sink* const buffer = m_free.back();
+        m_free.pop_back();
+        return buffer;
+    }
+
+    void release(buffer_sink* buffer)
+    {
+        m_high_water = std::max(m_high_water, buffer->size());
+
+        if (m_free.size() >= m_max_pooled)
+        {
+            delete buffer;
+            return;
+        }
+
+        buffer->clear();
+        buffer->reserve(m_high_water);
+        m_free.push_back(buffer);
+    }
+
+    // size of the largest message released so far
+    std::size_t high_water() const
+    {
+        return m_high_water;
+    }
+
+    // number of buffers ready to be handed out
+    std::size_t pooled() const
+    {
+        return m_free.size();
+    }
+
+#if MJW_CPP11_SUPPORTED
+    static buffer_pool& local()
+    {
+        static thread_local buffer_pool pool;
+        return pool;
+    }
+#endif
+};
+
+// A buffer borrowed from a buffer_pool for the lifetime of the handle
+class buffer_pool::handle
+{
+private:
+
+    buffer_pool& m_pool;
+    buffer_sink* m_buffer;
+
+    // not copyable
+    handle(const handle&);
+    handle& operator=(const handle&);
+
+public:
+
+    explicit handle(buffer_pool& pool) :
+        m_pool(pool),
+        m_buffer(pool.acquire())
+    {
+    }
+
+    ~handle()
+    {
+        m_pool.release(m_buffer);
+    }
+
+    buffer_sink& sink()
+    {
+        return *m_buffer;
+    }
+
+    const char* data() const
+    {
+        return m_buffer->data();
+    }
+
+    std::size_t size() const
+    {
+        return m_buffer->size();
+    }
+};
+
+class fixed_buffer_sink
+{
+private:
+
+    char* m_begin;
+    char* m_end;
+    char* m_capacity_end;
+    bool m_overflow;
+
+public:
+
+    fixed_buffer_sink(char* buffer, std::size_t capacity) :
+        m_begin(buffer),
+        m_end(buffer),
+        m_capacity_end(buffer + capacity),
+        m_overflow(false)
+    {
+    }
+
+    void put(char c)
+    {
+        if (m_end == m_capacity_end)
+        {
+            m_overflow = true;
+            return;
+        }
+        *m_end++ = c;
+    }
+
+    // output not fitting in the buffer is truncated
+    void write(const char* data, std::size_t size)
+    {
+        const std::size_t available = static_cast<std::size_t>(m_capacity_end - m_end);
+        if (size > available)
+        {
+            size = available;
+            m_overflow = true;
+        }
+        if (size > 0)
+        {
+            std::memcpy(m_end, data, size);
+            m_end += size;
+        }
+    }
+
+    void clear()
+    {
+        m_end = m_begin;
+        m_overflow = false;
+    }
+
+    const char* data() const
+    {
+        return m_begin;
+    }
+
+    std::size_t size() const
+    {
+        return static_cast<std::size_t>(m_end - m_begin);
+    }
+
+    std::size_t capacity() const
+    {
+        return static_cast<std::size_t>(m_capacity_end - m_begin);
+    }
+
+    bool overflow() const
+    {
+        return m_overflow;
+    }
+};
+
+// A sink that only counts the characters written to it, to compute the
+// exact size of a document before writing it. The length of strings and
+// integers is computed without formatting them.
+class counting_sink
+{
+private:
+
+    std::size_t m_size;
+
+public:
+
+    counting_sink() :
+        m_size(0)
+    {
+    }
+
+    void put(char)
+    {
+        m_size++;
+    }
+
+    void write(const char*, std::size_t size)
+    {
+        m_size += size;
+    }
+
+    void add(std::size_t size)
+    {
+        m_size += size;
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    void clear()
+    {
+        m_size = 0;
+    }
+};
+
+namespace detail
+{
+
+class counting_streambuf : public std::streambuf
+{
+private:
+
+    std::size_t m_size;
+
+protected:
+
+    virtual int_type overflow(int_type c)
+    {
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            m_size++;
+        }
+        return traits_type::not_eof(c);
+    }
+
+    virtual std::streamsize xsputn(const char*, std::streamsize size)
+    {
+        m_size += static_cast<std::size_t>(size);
+        return size;
+    }
+
+public:
+
+    counting_streambuf() :
+        m_size(0)
+    {
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    void clear()
+    {
+        m_size = 0;
+    }
+};
+
+} // namespace detail
+
+// Same as counting_sink, for value writers that need a std::ostream
+class counting_ostream : public std::ostream
+{
+private:
+
+    detail::counting_streambuf m_buffer;
+
+public:
+
+    counting_ostream() :
+        std::ostream(NULL)
+    {
+        rdbuf(&m_buffer);
+    }
+
+    std::size_t size() const
+    {
+        return m_buffer.size();
+    }
+
+    void clear()
+    {
+        m_buffer.clear();
+    }
+};
+
+// Makes the writers produce CBOR (RFC 8949) on the target sink (any sink,
+// std::ostream included). Objects and arrays written with the writers have
+// an indefinite length, ranges written with write_array a definite one.
+template<typename Target>
+class cbor_sink
+{
+private:
+
+    Target* m_target;
+
+public:
+
+    typedef cbor_encoding encoding;
+
+    explicit cbor_sink(Target& target) :
+        m_target(&target)
+    {
+    }
+
+    void put(char c)
+    {
+        detail::forward_put(*m_target, c);
+    }
+
+    void write(const char* data, std::size_t size)
+    {
+        detail::forward_write(*m_target, data, size);
+    }
+
+    Target& target() const
+    {
+        return *m_target;
+    }
+};
+
+// Makes the writers produce MessagePack into an owned buffer. MessagePack
+// containers start with their number of elements: the objects and arrays
+// written with the writers get 32-bit headers, patched when they are closed,
+// and the output is only complete once the top-level writer is closed.
+class msgpack_sink
+{
+private:
+
+    struct container
+    {
+        std::size_t header_offset;
+        detail::uint32 size;
+    };
+
+    buffer_sink m_buffer;
+    std::vector<container> m_open_containers;
+
+public:
+
+    typedef msgpack_encoding encoding;
+
+    explicit msgpack_sink(std::size_t initial_capacity = 0) :
+        m_buffer(initial_capacity)
+    {
+    }
+
+    void put(char c)
+    {
+        m_buffer.put(c);
+    }
+
+    void write(const char* data, std::size_t size)
+    {
+        m_buffer.write(data, size);
+    }
+
+    // used by the writers
+    void open_container(bool array)
+    {
+        const container c = { m_buffer.size(), 0 };
+        m_open_containers.push_back(c);
+
+        const char header[] = { static_cast<char>(array ? 0xdd : 0xdf), 0, 0, 0, 0 };
+        m_buffer.write(header, sizeof(header));
+    }
+
+    void count_element()
+    {
+        assert(!m_open_containers.empty());
+        if (m_open_containers.back().size == 0xffffffffU)
+        {
+            throw std::length_error("MessagePack cannot encode containers of 2^32 elements or more");
+        }
+        m_open_containers.back().size++;
+    }
+
+    void close_container()
+    {
+        assert(!m_open_containers.empty());
+        const container& c = m_open_containers.back();
+
+        char* const size = m_buffer.data() + c.header_offset + 1;
+        size[0] = static_cast<char>(c.size >> 24);
+        size[1] = static_cast<char>(c.size >> 16);
+        size[2] = static_cast<char>(c.size >> 8);
+        size[3] = static_cast<char>(c.size);
+
+        m_open_containers.pop_back();
+    }
+
+    const char* data() const
+    {
+        return m_buffer.data();
+    }
+
+    std::size_t size() const
+    {
+        return m_buffer.size();
+    }
+
+    std::string str() const
+    {
+        return m_buffer.str();
+    }
+
+    void clear()
+    {
+        m_buffer.clear();
+        m_open_containers.clear();
+    }
+};
+
+#if defined(MJW_ENABLE_ZLIB) || defined(MJW_ENABLE_ZSTD)
+namespace detail
+{
+
+enum compress_mode
+{
+    COMPRESS_CONTINUE,
+    COMPRESS_FLUSH, // everything compressed so far can be decompressed
+    COMPRESS_FINISH
+};
+
+} // namespace detail
+
+// A sink compressing its output, a block at a time, on another sink. The
+// compression is done by Codec (see deflate_sink and zstd_sink).
+template<typename Codec, typename Target>
+class compressing_sink
+{
+private:
+
+    Codec m_codec;
+    Target* m_target;
+    bool m_finished;
+    char* m_begin;
+    char* m_end;
+    char* m_capacity_end;
+
+    // not copyable
+    compressing_sink(const compressing_sink&);
+    compressing_sink& operator=(const compressing_sink&);
+
+    void compress(const char* data, std::size_t size, detail::compress_mode mode)
+    {
+        assert(!m_finished);
+        if (size > 0 || mode != detail::COMPRESS_CONTINUE)
+        {
+            m_codec.compress(*m_target, data, size, mode);
+        }
+    }
+
+    void compress_block(detail::compress_mode mode)
+    {
+        compress(m_begin, static_cast<std::size_t>(m_end - m_begin), mode);
+        m_end = m_begin;
+    }
+
+protected:
+
+    template<typename Arg>
+    compressing_sink(Target& target, std::size_t block_size, Arg arg) :
+        m_codec(arg),
+        m_target(&target),
+        m_finished(false),
+        m_begin(new char[std::max<std::size_t>(block_size, min_block_size)]),
+        m_end(m_begin),
+        m_capacity_end(m_begin + std::max<std::size_t>(block_size, min_block_size))
+    {
+    }
+
+    template<typename Arg1, typename Arg2>
+    compressing_sink(Target& target, std::size_t block_size, Arg1 arg1, Arg2 arg2) :
+        m_codec(arg1, arg2),
+        m_target(&target),
+        m_finished(false),
+        m_begin(new char[std::max<std::size_t>(block_size, min_block_size)]),
+        m_end(m_begin),
+        m_capacity_end(m_begin + std::max<std::size_t>(block_size, min_block_size))
+    {
+    }
+
+public:
+
+    enum
+    {
+        min_block_size = 4096
+    };
+
+    // finishes the compressed stream, if finish() was not called
+    ~compressing_sink()
+    {
+        if (!m_finished)
+        {
+            finish();
+        }
+        delete[] m_begin;
+    }
+
+    void put(char c)
+    {
+        if (m_end == m_capacity_end)
+        {
+            compress_block(detail::COMPRESS_CONTINUE);
+        }
+        *m_end++ = c;
+    }
+
+    void write(const char* data, std::size_t size)
+    {
+        if (size > static_cast<std::size_t>(m_capacity_end - m_end))
+        {
+            compress_block(detail::COMPRESS_CONTINUE);
+            if (size >= static_cast<std::size_t>(m_capacity_end - m_begin))
+            {
+                // too large to be worth copying
+                compress(data, size, detail::COMPRESS_CONTINUE);
+                return;
+            }
+        }
+        std::memcpy(m_end, data, size);
+        m_end += size;
+    }
+
+    // the block is enlarged when size exceeds its capacity
+    char* prepare(std::size_t size)
+    {
+        if (size > static_cast<std::size_t>(m_capacity_end - m_end))
+        {
+            compress_block(detail::COMPRESS_CONTINUE);
+            if (size > static_cast<std::size_t>(m_capacity_end - m_begin))
+            {
+                delete[] m_begin;
+                m_begin = new char[size];
+                m_end = m_begin;
+                m_capacity_end = m_begin + size;
+            }
+        }
+        return m_end;
+    }
+
+    void commit(std::size_t size)
+    {
+        m_end += size;
+    }
+
+    // Compresses the pending output and writes it on the target, so that it
+    // can be decompressed right away (e.g. after each record of a log).
+    // Flushing too often degrades the compression ratio.
+    void flush()
+    {
+        compress_block(detail::COMPRESS_FLUSH);
+    }
+
+    // Ends the compressed stream: nothing can be written afterwards
+    void finish()
+    {
+        compress_block(detail::COMPRESS_FINISH);
+        m_finished = true;
+    }
+
+    Target& target() const
+    {
+        return *m_target;
+    }
+
+    // the error code of the compression library (see the codec), or 0
+    int error() const
+    {
+        return m_codec.error();
+    }
+};
+#endif // MJW_ENABLE_ZLIB || MJW_ENABLE_ZSTD
+
+#if defined(MJW_ENABLE_ZLIB)
+enum deflate_format
+{
+    GZIP,
+    ZLIB,
+    RAW_DEFLATE
+};
+
+namespace detail
+{
+
+class deflate_codec
+{
+private:
+
+    z_stream m_stream;
+    int m_error;
+    char m_output[16384];
+
+    // not copyable
+    deflate_codec(const deflate_codec&);
+    deflate_codec& operator=(const deflate_codec&);
+
+    // compresses all the input set in m_stream
+    template<typename Target>
+    bool deflate_input(Target& target, int flush)
+    {
+        do
+        {
+            m_stream.next_out = reinterpret_cast<Bytef*>(m_output);
+            m_stream.avail_out = sizeof(m_output);
+
+            const int status = deflate(&m_stream, flush);
+            if (status == Z_STREAM_ERROR)
+            {
+                m_error = status;
+                return false;
+            }
+
+            forward_write(target, m_output, sizeof(m_output) - m_stream.avail_out);
+        }
+        while (m_stream.avail_out == 0);
+
+        return true;
+    }
+
+public:
+
+    deflate_codec(int level, deflate_format format) :
+        m_error(0)
+    {
+        std::memset(&m_stream, 0, sizeof(m_stream));
+
+        const int window_bits = format == GZIP ? 15 + 16 : format == ZLIB ? 15 : -15;
+        const int status = deflateInit2(&m_stream, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+        if (status != Z_OK)
+        {
+            m_error = status;
+        }
+    }
+
+    ~deflate_codec()
+    {
+        deflateEnd(&m_stream);
+    }
+
+    template<typename Target>
+    void compress(Target& target, const char* data, std::size_t size, compress_mode mode)
+    {
+        if (m_error != 0)
+        {
+            return;
+        }
+
+        const int flush = mode == COMPRESS_FINISH ? Z_FINISH : mode == COMPRESS_FLUSH ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+        // avail_in is a uInt: larger inputs are fed in slices, and only the
+        // last one is flushed
+        do
+        {
+            const std::size_t slice = std::min<std::size_t>(size, std::numeric_limits<uInt>::max());
+            m_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+            m_stream.avail_in = static_cast<uInt>(slice);
+            data += slice;
+            size -= slice;
+
+            if (!deflate_input(target, size == 0 ? flush : Z_NO_FLUSH))
+            {
+                return;
+            }
+        }
+        while (size > 0);
+    }
+
+    // a zlib status code
+    int error() const
+    {
+        return m_error;
+    }
+};
+
+} // namespace detail
+
+// Compresses its output with deflate, in the gzip (default), zlib or raw
+// format, on the target sink (any sink, std::ostream included)
+template<typename Target>
+class deflate_sink : public compressing_sink<detail::deflate_codec, Target>
+{
+public:
+
+    explicit deflate_sink(Target& target, int level = Z_DEFAULT_COMPRESSION, deflate_format format = GZIP, std::size_t block_size = 16384) :
+        compressing_sink<detail::deflate_codec, Target>(target, block_size, level, format)
+    {
+    }
+};
+#endif // MJW_ENABLE_ZLIB
+
+#if defined(MJW_ENABLE_ZSTD)
+namespace detail
+{
+
+class zstd_codec
+{
+private:
+
+    ZSTD_CCtx* m_context;
+    ZSTD_ErrorCode m_error;
+    std::vector<char> m_output;
+
+    // not copyable
+    zstd_codec(const zstd_codec&);
+    zstd_codec& operator=(const zstd_codec&);
+
+    bool check(std::size_t result)
+    {
+        if (ZSTD_isError(result))
+        {
+            m_error = ZSTD_getErrorCode(result);
+            return false;
+        }
+        return true;
+    }
+
+public:
+
+    explicit zstd_codec(int level) :
+        m_context(ZSTD_createCCtx()),
+        m_error(ZSTD_error_no_error),
+        m_output(ZSTD_CStreamOutSize())
+    {
+        if (m_context == NULL)
+        {
+            m_error = ZSTD_error_memory_allocation;
+            return;
+        }
+        check(ZSTD_CCtx_setParameter(m_context, ZSTD_c_compressionLevel, level));
+    }
+
+    ~zstd_codec()
+    {
+        ZSTD_freeCCtx(m_context);
+    }
+
+    template<typename Target>
+    void compress(Target& target, const char* data, std::size_t size, compress_mode mode)
+    {
+        if (m_error != ZSTD_error_no_error)
+        {
+            return;
+        }
+
+        const ZSTD_EndDirective directive = mode == COMPRESS_FINISH ? ZSTD_e_end : mode == COMPRESS_FLUSH ? ZSTD_e_flush : ZSTD_e_continue;
+        ZSTD_inBuffer input = { data, size, 0 };
+
+        for (;;)
+        {
+            ZSTD_outBuffer output = { &m_output[0], m_output.size(), 0 };
+            const std::size_t remaining = ZSTD_compressStream2(m_context, &output, &input, directive);
+            if (!check(remaining))
+            {
+                return;
+            }
+
+            forward_write(target, &m_output[0], output.pos);
+
+            // with ZSTD_e_continue, the input only needs to be consumed
+            const bool done = directive == ZSTD_e_continue ? input.pos == input.size : remaining == 0;
+            if (done)
+            {
+                return;
+            }
+        }
+    }
+
+    // a ZSTD_ErrorCode (see ZSTD_getErrorString())
+    int error() const
+    {
+        return static_cast<int>(m_error);
+    }
+};
+
+} // namespace detail
+
+// Compresses its output with Zstandard on the target sink
+template<typename Target>
+class zstd_sink : public compressing_sink<detail::zstd_codec, Target>
+{
+public:
+
+    explicit zstd_sink(Target& target, int level = 3, std::size_t block_size = 131072) :
+        compressing_sink<detail::zstd_codec, Target>(target, block_size, level)
+    {
+    }
+};
+#endif // MJW_ENABLE_ZSTD
+
+#if MJW_POSIX_SUPPORTED
+class fd_sink
+{
+private:
+
+    int m_fd;
+    int m_error;
+    char* m_begin;
+    char* m_end;
+    char* m_capacity_end;
+
+    // not copyable
+    fd_sink(const fd_sink&);
+    fd_sink& operator=(const fd_sink&);
+
+    void write_fully(const char* data, std::size_t size)
+    {
+        while (size > 0 && m_error == 0)
+        {
+            const ssize_t written = ::write(m_fd, data, size);
+            if (written < 0)
+            {
+                if (errno != EINTR)
+                {
+                    m_error = errno;
+                }
+                continue;
+            }
+            if (written == 0)
+            {
+                // no progress, and no errno to report
+                m_error = EIO;
+                break;
+            }
+            data += written;
+            size -= static_cast<std::size_t>(written);
+        }
+    }
+
+public:
+
+    enum
+    {
+        min_buffer_size = 64
+    };
+
+    // the buffer is never smaller than min_buffer_size
+    explicit fd_sink(int fd, std::size_t buffer_size = 8192) :
+        m_fd(fd),
+        m_error(0),
+        m_begin(new char[std::max<std::size_t>(buffer_size, min_buffer_size)]),
+        m_end(m_begin),
+        m_capacity_end(m_begin + std::max<std::size_t>(buffer_size, min_buffer_size))
+    {
+    }
+
+    // flushes, but never closes the file descriptor
+    ~fd_sink()
+    {
+        flush();
+        delete[] m_begin;
+    }
+
+    void put(char c)
+    {
+        if (m_end == m_capacity_end)
+        {
+            flush();
+        }
+        *m_end++ = c;
+    }
+
+    void write(const char* data, std::size_t size)
+    {
+        if (size > static_cast<std::size_t>(m_capacity_end - m_end))
+        {
+            flush();
+            if (size >= static_cast<std::size_t>(m_capacity_end - m_begin))
+            {
+                // too large to be worth buffering
+                write_fully(data, size);
+                return;
+            }
+        }
+        std::memcpy(m_end, data, size);
+        m_end += size;
+    }
+
+    // the buffer is enlarged when size exceeds its capacity
+    char* prepare(std::size_t size)
+    {
+        if (size > static_cast<std::size_t>(m_capacity_end - m_end))
+        {
+            flush();
+            if (size > static_cast<std::size_t>(m_capacity_end - m_begin))
+            {
+                delete[] m_begin;
+                m_begin = new char[size];
+                m_end = m_begin;
+                m_capacity_end = m_begin + size;
+            }
+        }
+        return m_end;
+    }
+
+    void commit(std::size_t size)
+    {
+        m_end += size;
+    }
+
+    void flush()
+    {
+        write_fully(m_begin, static_cast<std::size_t>(m_end - m_begin));
+        m_end = m_begin;
+    }
+
+    int fd() const
+    {
+        return m_fd;
+    }
+
+    // the errno of the first failed write, or 0
+    int error() const
+    {
+        return m_error;
+    }
+};
+
+// A sink writing straight into a memory-mapped file, from its beginning.
+// The file is grown, and the mapping enlarged, by extents of extent_size
+// bytes; close() (also called by the destructor) unmaps it and truncates
+// the file to the size written. The file descriptor, opened for reading and
+// writing, is never closed.
+class mmap_sink
+{
+public:
+
+    struct options
+    {
+        // rounded up to a multiple of the page size
+        std::size_t extent_size;
+        // whether the written pages are handed to msync(MS_ASYNC) whenever
+        // the file grows, and on close(), so that they are written back early
+        bool async_msync;
+
+        options() :
+            extent_size(64 * 1024 * 1024),
+            async_msync(false)
+        {
+        }
+    };
+
+private:
+
+    int m_fd;
+    int m_error;
+    options m_options;
+    std::size_t m_page_size;
+    char* m_map;
+    std::size_t m_mapped;
+    std::size_t m_size;
+    bool m_closed;
+    std::vector<char> m_scratch; // handed out by prepare() after an error
+
+    mmap_sink(const mmap_sink&);
+    mmap_sink& operator=(const mmap_sink&);
+
+    void start_writeback()
+    {
+        const std::size_t written_pages = m_size / m_page_size * m_page_size;
+        if (m_options.async_msync && written_pages > 0)
+        {
+            ::msync(m_map, written_pages, MS_ASYNC);
+        }
+    }
+
+    // Reserves the new extent on disk, so that running out of space fails
+    // here rather than with SIGBUS when the pages are written
+    int extend_file(std::size_t size)
+    {
+#if defined(__linux__)
+        const int result = ::posix_fallocate(m_fd, static_cast<off_t>(m_mapped), static_cast<off_t>(size - m_mapped));
+        if (result != EINVAL && result != EOPNOTSUPP)
+        {
+            return result;
+        }
+#endif
+        return ::ftruncate(m_fd, static_cast<off_t>(size)) == 0 ? 0 : errno;
+    }
+
+    bool grow(std::size_t min_extra)
+    {
+        if (m_error != 0 || m_closed)
+        {
+            return false;
+        }
+
+        std::size_t new_mapped = m_mapped + m_options.extent_size;
+        if (new_mapped < m_size + min_extra)
+        {
+            new_mapped = (m_size + min_extra + m_page_size - 1) / m_page_size * m_page_size;
+        }
+
+        start_writeback();
+        m_error = extend_file(new_mapped);
+        if (m_error != 0)
+        {
+            return false;
+        }
+
+        void* map;
+#if defined(__linux__)
+        if (m_map != NULL)
+        {
+            map = ::mremap(m_map, m_mapped, new_mapped, MREMAP_MAYMOVE);
+        }
+        else
+#endif
+        {
+            if (m_map != NULL)
+            {
+                ::munmap(m_map, m_mapped);
+                m_map = NULL;
+            }
+            map = ::mmap(NULL, new_mapped, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        }
+        if (map == MAP_FAILED)
+        {
+            m_error = errno;
+            if (m_map != NULL)
+            {
+                ::munmap(m_map, m_mapped);
+                m_map = NULL;
+            }
+            m_mapped = 0;
+            return false;
+        }
+
+        m_map = static_cast<char*>(map);
+        m_mapped = new_mapped;
+        ::madvise(m_map, m_mapped, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    bool reserve(std::size_t size)
+    {
+        return (m_map != NULL && size <= m_mapped - m_size) || grow(size);
+    }
+
+public:
+
+    explicit mmap_sink(int fd, const options& opts = options()) :
+        m_fd(fd),
+        m_error(0),
+        m_options(opts),
+        m_page_size(static_cast<std::size_t>(::sysconf(_SC_PAGESIZE))),
+        m_map(NULL),
+        m_mapped(0),
+        m_size(0),
+        m_closed(false)
+    {
+        m_options.extent_size = std::max<std::size_t>((m_options.extent_size + m_page_size - 1) / m_page_size * m_page_size, m_page_size);
+    }
+
+    ~mmap_sink()
+    {
+        close();
+    }
+
+    void put(char c)
+    {
+        if (reserve(1))
+        {
+            m_map[m_size++] = c;
+        }
+    }
+
+    void write(const char* data, std::size_t size)
+    {
+        if (size > 0 && reserve(size))
+        {
+            std::memcpy(m_map + m_size, data, size);
+            m_size += size;
+        }
+    }
+
+    char* prepare(std::size_t size)
+    {
+        if (reserve(size))
+        {
+            return m_map + m_size;
+        }
+        m_scratch.resize(std::max<std::size_t>(size, 1));
+        return &m_scratch[0];
+    }
+
+    void commit(std::size_t size)
+    {
+        if (m_error == 0 && !m_closed)
+        {
+            m_size += size;
+        }
+    }
+
+    // Unmaps the file and truncates it to the size written; nothing can be
+    // written afterwards
+    void close()
+    {
+        if (m_closed)
+        {
+            return;
+        }
+        m_closed = true;
+        if (m_map != NULL)
+        {
+            start_writeback();
+            ::munmap(m_map, m_mapped);
+            m_map = NULL;
+            m_mapped = 0;
+        }
+        if (::ftruncate(m_fd, static_cast<off_t>(m_size)) != 0 && m_error == 0)
+        {
+            m_error = errno;
+        }
+    }
+
+    // the number of bytes written
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    int fd() const
+    {
+        return m_fd;
+    }
+
+    // the errno of the first failed system call, or 0
+    int error() const
+    {
+        return m_error;
+    }
+};
+#endif // MJW_POSIX_SUPPORTED
+
+#if MJW_POSIX_SUPPORTED
+namespace detail
+{
+
+// Skips the first size bytes of the buffers
+inline void advance_iovecs(struct iovec*& iov, std::size_t& count, std::size_t size)
+{
+    while (count > 0 && size >= iov->iov_len)
+    {
+        size -= iov->iov_len;
+        iov++;
+        count--;
+    }
+    if (count > 0)
+    {
+        iov->iov_base = static_cast<char*>(iov->iov_base) + size;
+        iov->iov_len -= size;
+    }
+}
+
+// Writes all the buffers, resuming after partial writes; returns 0 or the
+// errno of the failed write. The iovec array is modified.
+inline int writev_fully(int fd, struct iovec* iov, std::size_t count)
+{
+    while (count > 0)
+    {
+        const int batch = static_cast<int>(std::min<std::size_t>(count, MJW_IOV_MAX));
+        const ssize_t written = ::writev(fd, iov, batch);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno;
+        }
+
+        advance_iovecs(iov, count, static_cast<std::size_t>(written));
+    }
+
+    return 0;
+}
+
+// Same as writev_fully, with sendmsg() and its flags (e.g. MSG_NOSIGNAL)
+inline int sendmsg_fully(int socket, struct iovec* iov, std::size_t count, int flags)
+{
+    while (count > 0)
+    {
+        struct msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = iov;
+        message.msg_iovlen = std::min<std::size_t>(count, MJW_IOV_MAX);
+
+        const ssize_t sent = ::sendmsg(socket, &message, flags);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno;
+        }
+
+        advance_iovecs(iov, count, static_cast<std::size_t>(sent));
+    }
+
+    return 0;
+}
+
+} // namespace detail
+
+// A sink assembling the document as a list of buffers, emitted with a single
+// writev() or sendmsg(). The formatted output is staged in an owned buffer,
+// while the clean runs of external_string values that are at least
+// min_reference_size long are referenced where they are, rather than copied.
+// Referenced strings must stay alive and unchanged until the sink is written
+// out or cleared.
+class iovec_sink
+{
+private:
+
+    struct reference
+    {
+        std::size_t staging_offset; // where the reference is in the output
+        const char* data;
+        std::size_t size;
+    };
+
+    buffer_sink m_staging;
+    std::vector<reference> m_references;
+    std::size_t m_min_reference_size;
+    std::size_t m_referenced_size;
+
+    // not copyable
+    iovec_sink(const iovec_sink&);
+    iovec_sink& operator=(const iovec_sink&);
+
+public:
+
+    explicit iovec_sink(std::size_t min_reference_size = 1024) :
+        m_min_reference_size(min_reference_size),
+        m_referenced_size(0)
+    {
+    }
+
+    void put(char c)
+    {
+        m_staging.put(c);
+    }
+
+    void write(const char* data, std::size_t size)
+    {
+        m_staging.write(data, size);
+    }
+
+    char* prepare(std::size_t size)
+    {
+        return m_staging.prepare(size);
+    }
+
+    void commit(std::size_t size)
+    {
+        m_staging.commit(size);
+    }
+
+    // keeps a reference to data, unless it is shorter than min_reference_size
+    void write_external(const char* data, std::size_t size)
+    {
+        if (size < m_min_reference_size)
+        {
+            m_staging.write(data, size);
+            return;
+        }
+
+        const reference ref = { m_staging.size(), data, size };
+        m_references.push_back(ref);
+        m_referenced_size += size;
+    }
+
+    // total size of the output
+    std::size_t size() const
+    {
+        return m_staging.size() + m_referenced_size;
+    }
+
+    // bytes referenced rather than copied
+    std::size_t referenced_size() const
+    {
+        return m_referenced_size;
+    }
+
+    void clear()
+    {
+        m_staging.clear();
+        m_references.clear();
+        m_referenced_size = 0;
+    }
+
+    // Replaces the content of iov with the buffers making up the output, in
+    // order. They are valid until the sink is modified.
+    void gather(std::vector<struct iovec>& iov) const
+    {
+        iov.clear();
+        iov.reserve(m_references.size() * 2 + 1);
+
+        std::size_t offset = 0;
+        for (std::size_t i = 0; i < m_references.size(); i++)
+        {
+            const reference& ref = m_references[i];
+            if (ref.staging_offset > offset)
+            {
+                append(iov, m_staging.data() + offset, ref.staging_offset - offset);
+                offset = ref.staging_offset;
+            }
+            append(iov, ref.data, ref.size);
+        }
+        if (m_staging.size() > offset)
+        {
+            append(iov, m_staging.data() + offset, m_staging.size() - offset);
+        }
+    }
+
+    // Writes the whole output to a file descriptor; returns 0 or the errno of
+    // the failed write. The sink is left unchanged.
+    int write_to(int fd) const
+    {
+        std::vector<struct iovec> iov;
+        gather(iov);
+        return iov.empty() ? 0 : detail::writev_fully(fd, &iov[0], iov.size());
+    }
+
+    // Same as write_to, through sendmsg() with the given flags
+    int send_to(int socket, int flags = 0) const
+    {
+        std::vector<struct iovec> iov;
+        gather(iov);
+        return iov.empty() ? 0 : detail::sendmsg_fully(socket, &iov[0], iov.size(), flags);
+    }
+
+private:
+
+    static void append(std::vector<struct iovec>& iov, const char* data, std::size_t size)
+    {
+        struct iovec buffer;
+        buffer.iov_base = const_cast<char*>(data);
+        buffer.iov_len = size;
+        iov.push_back(buffer);
+    }
+};
+#endif // MJW_POSIX_SUPPORTED
+
+#if MJW_CPP11_SUPPORTED && MJW_POSIX_SUPPORTED
+// A sink for structured logs written by many threads to the same file
+// descriptor. Each thread serialises a record into a thread-local buffer,
+// then publishes it through a lock-free queue; a background thread gathers
+// the published records and writes them in batches with writev().
+// Records are never interleaved, and the ones published before shutdown()
+// (or the destruction of the sink) are all written.
+class async_log_sink
+{
+public:
+
+    struct options
+    {
+        // the batch is written when it reaches this size...
+        std::size_t flush_bytes;
+        // ...or when its oldest record has waited this long
+        std::chrono::milliseconds flush_interval;
+        // whether a newline is appended to every record (NDJSON)
+        bool newline;
+
+        options() :
+            flush_bytes(64 * 1024),
+            flush_interval(100),
+            newline(true)
+        {
+        }
+    };
+
+    class record;
+
+private:
+
+    struct node
+    {
+        std::atomic<node*> next;
+        std::size_t size;
+
+        char* data()
+        {
+            return reinterpret_cast<char*>(this + 1);
+        }
+    };
+
+    options m_options;
+    int m_fd;
+    std::atomic<int> m_error;
+    std::atomic<bool> m_stopping;
+
+    // Vyukov's intrusive MPSC queue: producers exchange m_head, the
+    // background thread alone pops from m_tail
+    std::atomic<node*> m_head;
+    node* m_tail;
+    node m_stub;
+
+    // the published records not popped yet: the background thread sleeps
+    // on m_wakeup while there are none
+    std::atomic<std::size_t> m_pending;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+
+    std::thread m_thread;
+
+    async_log_sink(const async_log_sink&) = delete;
+    async_log_sink& operator=(const async_log_sink&) = delete;
+
+    void push(node* n)
+    {
+        n->next.store(nullptr, std::memory_order_relaxed);
+        node* const previous = m_head.exchange(n, std::memory_order_acq_rel);
+        previous->next.store(n, std::memory_order_release);
+    }
+
+    // returns nullptr when the queue is empty, or a push is in progress
+    node* pop()
+    {
+        node* tail = m_tail;
+        node* next = tail->next.load(std::memory_order_acquire);
+
+        if (tail == &m_stub)
+        {
+            if (next == nullptr)
+            {
+                return nullptr;
+            }
+            m_tail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+
+        if (next != nullptr)
+        {
+            m_tail = next;
+            return tail;
+        }
+
+        if (tail != m_head.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+
+        push(&m_stub);
+
+        next = tail->next.load(std::memory_order_acquire);
+        if (next != nullptr)
+        {
+            m_tail = next;
+            return tail;
+        }
+
+        return nullptr;
+    }
+
+    static void destroy(node* n)
+    {
+        n->~node();
+        delete[] reinterpret_cast<char*>(n);
+    }
+
+    void flush(std::vector<node*>& batch, std::vector<struct iovec>& iov)
+    {
+        iov.resize(batch.size());
+        for (std::size_t i = 0; i < batch.size(); i++)
+        {
+            iov[i].iov_base = batch[i]->data();
+            iov[i].iov_len = batch[i]->size;
+        }
+
+        if (m_error.load(std::memory_order_relaxed) == 0)
+        {
+            const int error = detail::writev_fully(m_fd, iov.data(), iov.size());
+            if (error != 0)
+            {
+                m_error.store(error, std::memory_order_relaxed);
+            }
+        }
+
+        for (std::size_t i = 0; i < batch.size(); i++)
+        {
+            destroy(batch[i]);
+        }
+        batch.clear();
+    }
+
+    bool has_work() const
+    {
+        return m_pending.load(std::memory_order_acquire) != 0 || m_stopping.load(std::memory_order_acquire);
+    }
+
+    void run()
+    {
+        typedef std::chrono::steady_clock clock;
+
+        std::vector<node*> batch;
+        std::vector<struct iovec> iov;
+        std::size_t batch_bytes = 0;
+        clock::time_point batch_start;
+
+        for (;;)
+        {
+            // read before draining, so that nothing published before shutdown() is missed
+            const bool stopping = m_stopping.load(std::memory_order_acquire);
+
+            while (node* const n = pop())
+            {
+                // wraps around for a moment when the record is popped
+                // before its publisher has counted it
+                m_pending.fetch_sub(1, std::memory_order_relaxed);
+
+                if (batch.empty())
+                {
+                    batch_start = clock::now();
+                }
+                batch.push_back(n);
+                batch_bytes += n->size;
+
+                if (batch_bytes >= m_options.flush_bytes)
+                {
+                    flush(batch, iov);
+                    batch_bytes = 0;
+                }
+            }
+
+            if (!batch.empty() && (stopping || clock::now() - batch_start >= m_options.flush_interval))
+            {
+                flush(batch, iov);
+                batch_bytes = 0;
+            }
+
+            if (stopping)
+            {
+                break;
+            }
+
+            // returns at once when a record is pending but its push is
+            // still in progress, which only lasts a couple of instructions
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (batch.empty())
+            {
+                m_wakeup.wait(lock, [this] { return has_work(); });
+            }
+            else
+            {
+                m_wakeup.wait_until(lock, batch_start + m_options.flush_interval, [this] { return has_work(); });
+            }
+        }
+    }
+
+public:
+
+    // the file descriptor is never closed by the sink
+    explicit async_log_sink(int fd, const options& opts = options()) :
+        m_options(opts),
+        m_fd(fd),
+        m_error(0),
+        m_stopping(false),
+        m_head(&m_stub),
+        m_tail(&m_stub),
+        m_pending(0)
+    {
+        m_stub.next.store(nullptr, std::memory_order_relaxed);
+        m_stub.size = 0;
+        m_thread = std::thread(&async_log_sink::run, this);
+    }
+
+    ~async_log_sink()
+    {
+        shutdown();
+
+        while (node* const n = pop())
+        {
+            destroy(n);
+        }
+    }
+
+    // Thread-safe; the data is copied
+    void publish(const char* data, std::size_t size)
+    {
+        const std::size_t total_size = size + (m_options.newline ? 1 : 0);
+
+        char* const memory = new char[sizeof(node) + total_size];
+        node* const n = new (memory) node;
+        n->size = total_size;
+        std::memcpy(n->data(), data, size);
+        if (m_options.newline)
+        {
+            n->data()[size] = '\n';
+        }
+
+        push(n);
+
+        // only the first record published after the queue was drained wakes
+        // the background thread up
+        if (m_pending.fetch_add(1, std::memory_order_acq_rel) == 0)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_wakeup.notify_one();
+        }
+    }
+
+    // Writes the pending records and stops the background thread; nothing
+    // can be published afterwards
+    void shutdown()
+    {
+        if (m_thread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopping.store(true, std::memory_order_release);
+            }
+            m_wakeup.notify_one();
+            m_thread.join();
+
+            // the records whose push was still in progress when the
+            // background thread drained the queue for the last time
+            std::vector<node*> batch;
+            std::vector<struct iovec> iov;
+            while (node* const n = pop())
+            {
+                batch.push_back(n);
+            }
+            if (!batch.empty())
+            {
+                flush(batch, iov);
+            }
+        }
+    }
+
+    // the errno of the first failed write, or 0
+    int error() const
+    {
+        return m_error.load(std::memory_order_relaxed);
+    }
+};
+
+// A record being serialised into the calling thread's buffer:
+//
+//   minijson::async_log_sink::record record(log);
+//   minijson::basic_object_writer<minijson::buffer_sink> writer(record.sink());
+//   ...
+//   writer.close();
+//   record.commit();
+class async_log_sink::record
+{
+private:
+
+    async_log_sink& m_log;
+    buffer_sink* m_buffer;
+    buffer_sink m_own_buffer; // only used when records are nested on the same thread
+    bool m_uses_thread_buffer;
+
+    static buffer_sink& thread_buffer()
+    {
+        static thread_local buffer_sink buffer;
+        return buffer;
+    }
+
+    static bool& thread_buffer_in_use()
+    {
+        static thread_local bool in_use = false;
+        return in_use;
+    }
+
+    record(const record&) = delete;
+    record& operator=(const record&) = delete;
+
+public:
+
+    explicit record(async_log_sink& log) :
+        m_log(log),
+        m_buffer(&m_own_buffer),
+        m_uses_thread_buffer(!thread_buffer_in_use())
+    {
+        if (m_uses_thread_buffer)
+        {
+            thread_buffer_in_use() = true;
+            m_buffer = &thread_buffer();
+            m_buffer->clear();
+        }
+    }
+
+    // an uncommitted record is discarded
+    ~record()
+    {
+        if (m_uses_thread_buffer)
+        {
+            thread_buffer_in_use() = false;
+        }
+    }
+
+    buffer_sink& sink()
+    {
+        return *m_buffer;
+    }
+
+    // publishes the record; the buffer is then cleared for reuse
+    void commit()
+    {
+        m_log.publish(m_buffer->data(), m_buffer->size());
+        m_buffer->clear();
+    }
+};
+#endif // MJW_CPP11_SUPPORTED && MJW_POSIX_SUPPORTED
+
+#if MJW_CPP11_SUPPORTED && MJW_UCONTEXT_SUPPORTED
+// Produces a document in chunks of the caller's choosing, for non-blocking
+// sockets. The producer function writes the whole document on a
+// pull_serializer::sink as usual, but runs on its own stack: when the chunk
+// passed to pull() is full, it is suspended, at any byte boundary (even in
+// the middle of a string or a number), and resumed by the next pull(). Only
+// the producer's stack and the caller's chunk are needed, whatever the size
+// of the document. Destroying a serializer whose producer is suspended
+// unwinds the producer's stack. Neither copyable nor movable; pull() must
+// not be called concurrently.
+class pull_serializer
+{
+public:
+
+    // the producer's sink
+    class sink
+    {
+    private:
+
+        pull_serializer& m_serializer;
+
+        friend class pull_serializer;
+
+        explicit sink(pull_serializer& serializer) :
+            m_serializer(serializer)
+        {
+        }
+
+    public:
+
+        void put(char c)
+        {
+            m_serializer.output(&c, 1);
+        }
+
+        void write(const char* data, std::size_t size)
+        {
+            m_serializer.output(data, size);
+        }
+    };
+
+    typedef std::function<void(sink&)> producer;
+
+private:
+
+    struct cancelled
+    {
+    };
+
+    producer m_producer;
+    std::size_t m_stack_size;
+    char* m_stack; // mapped with a guard page below it
+    std::size_t m_mapped_size;
+    ucontext_t m_caller;
+    ucontext_t m_context;
+    char* m_chunk;
+    std::size_t m_chunk_size;
+    std::size_t m_filled;
+    bool m_started;
+    bool m_done;
+    bool m_cancelled;
+    std::exception_ptr m_exception;
+
+    pull_serializer(const pull_serializer&) = delete;
+    pull_serializer& operator=(const pull_serializer&) = delete;
+
+    // makecontext() only passes int arguments
+    static void run(unsigned int high, unsigned int low)
+    {
+        const std::uint64_t address = (static_cast<std::uint64_t>(high) << 32) | low;
+        reinterpret_cast<pull_serializer*>(static_cast<std::uintptr_t>(address))->produce();
+        // returning switches to uc_link, i.e. back to pull()
+    }
+
+    void produce()
+    {
+        try
+        {
+            sink output(*this);
+            m_producer(output);
+        }
+        catch (const cancelled&)
+        {
+        }
+        catch (...)
+        {
+            m_exception = std::current_exception();
+        }
+
+        m_done = true;
+    }
+
+    void output(const char* data, std::size_t size)
+    {
+        for (;;)
+        {
+            if (m_cancelled)
+            {
+                throw cancelled();
+            }
+
+            const std::size_t count = std::min(size, m_chunk_size - m_filled);
+            if (count > 0)
+            {
+                std::memcpy(m_chunk + m_filled, data, count);
+                m_filled += count;
+                data += count;
+                size -= count;
+            }
+            if (size == 0)
+            {
+                return;
+            }
+
+            // the chunk is full: suspended until the next pull()
+            swapcontext(&m_context, &m_caller);
+        }
+    }
+
+    // The stack grows downwards: overflowing it hits the inaccessible page
+    // below, and crashes rather than silently corrupting other memory
+    void allocate_stack()
+    {
+        const std::size_t page_size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+        const std::size_t stack_size = (m_stack_size + page_size - 1) / page_size * page_size;
+
+        void* const mapping = ::mmap(nullptr, stack_size + page_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (mapping == MAP_FAILED)
+        {
+            throw std::bad_alloc();
+        }
+        if (::mprotect(mapping, page_size, PROT_NONE) != 0)
+        {
+            ::munmap(mapping, stack_size + page_size);
+            throw std::bad_alloc();
+        }
+
+        m_mapped_size = stack_size + page_size;
+        m_stack = static_cast<char*>(mapping);
+        m_stack_size = stack_size;
+    }
+
+    void start()
+    {
+        allocate_stack();
+        getcontext(&m_context);
+        m_context.uc_stack.ss_sp = m_stack + (m_mapped_size - m_stack_size);
+        m_context.uc_stack.ss_size = m_stack_size;
+        m_context.uc_link = &m_caller;
+
+        const std::uint64_t address = reinterpret_cast<std::uintptr_t>(this);
+        makecontext(&m_context, reinterpret_cast<void (*)()>(&pull_serializer::run), 2,
+            static_cast<unsigned int>(address >> 32), static_cast<unsigned int>(address));
+
+        m_started = true;
+    }
+
+public:
+
+    // the stack (rounded up to whole pages) must be large enough for the
+    // producer and the value writers it uses: an overflow crashes the process
+    explicit pull_serializer(producer p, std::size_t stack_size = 256 * 1024) :
+        m_producer(std::move(p)),
+        m_stack_size(stack_size),
+        m_stack(nullptr),
+        m_mapped_size(0),
+        m_chunk(nullptr),
+        m_chunk_size(0),
+        m_filled(0),
+        m_started(false),
+        m_done(false),
+        m_cancelled(false)
+    {
+    }
+
+    ~pull_serializer()
+    {
+        if (m_started && !m_done)
+        {
+            m_cancelled = true;
+            swapcontext(&m_caller, &m_context);
+        }
+        if (m_stack != nullptr)
+        {
+            ::munmap(m_stack, m_mapped_size);
+        }
+    }
+
+    // Writes the next part of the document (at most size > 0 characters) into
+    // buffer, and returns its length: 0 once the document is complete. An
+    // exception thrown by the producer is rethrown here.
+    std::size_t pull(char* buffer, std::size_t size)
+    {
+        assert(size > 0);
+
+        if (m_done)
+        {
+            return 0;
+        }
+
+        m_chunk = buffer;
+        m_chunk_size = size;
+        m_filled = 0;
+
+        if (!m_started)
+        {
+            start();
+        }
+        swapcontext(&m_caller, &m_context);
+
+        if (m_exception)
+        {
+            std::exception_ptr exception;
+            std::swap(exception, m_exception);
+            std::rethrow_exception(exception);
+        }
+
+        return m_filled;
+    }
+
+    bool done() const
+    {
+        return m_done;
+    }
+};
+#endif // MJW_CPP11_SUPPORTED && MJW_UCONTEXT_SUPPORTED
+
+// Memoizes serialised subtrees, keyed by object identity (or any other
+// ordered key) and version. get() renders a subtree into a buffer_sink only
+// when it is not cached, or was cached with a different version, and returns
+// the cached bytes, valid until the entry is rendered again, invalidated or
+// cleared. Not thread-safe.
+template<typename Key = const void*>
+class subtree_cache
+{
+private:
+
+    struct entry
+    {
+        unsigned long long version;
+        std::string json;
+    };
+
+    typedef std::map<Key, entry> entries;
+
+    entries m_entries;
+    buffer_sink m_scratch;
+
+    // not copyable
+    subtree_cache(const subtree_cache&);
+    subtree_cache& operator=(const subtree_cache&);
+
+public:
+
+    subtree_cache()
+    {
+    }
+
+    // render is called as render(sink), with a buffer_sink& to write the subtree on
+    template<typename Render>
+    raw_json get(const Key& key, unsigned long long version, Render render)
+    {
+        typename entries::iterator it = m_entries.find(key);
+        if (it != m_entries.end() && it->second.version == version)
+        {
+            return raw_json(it->second.json);
+        }
+
+        detail::detached_stats stats;
+        m_scratch.clear();
+        {
+            // the subtree's bytes are counted when it is written
+            const detail::detached_instrumentation detached;
+            render(m_scratch);
+            stats = detached.stats();
+        }
+        detail::attach_instrumentation<buffer_sink>(stats);
+
+        if (it == m_entries.end())
+        {
+            it = m_entries.insert(typename entries::value_type(key, entry())).first;
+        }
+        it->second.version = version;
+        it->second.json.assign(m_scratch.data(), m_scratch.size());
+
+        return raw_json(it->second.json);
+    }
+
+    template<typename Render>
+    raw_json get(const Key& key, Render render)
+    {
+        return get(key, 0, render);
+    }
+
+    void invalidate(const Key& key)
+    {
+        m_entries.erase(key);
+    }
+
+    void clear()
+    {
+        m_entries.clear();
+    }
+
+    std::size_t size() const
+    {
+        return m_entries.size();
+    }
+};
+
+// A field name already quoted, escaped and followed by the colon, built
+// once and written with a single copy. The name itself is kept for the
+// binary formats.
+class key
+{
+private:
+
+    std::string m_rendered;
+    std::string m_name;
+
+public:
+
+    explicit key(const string_ref& name) :
+        m_name(name.data(), name.size())
+    {
+        // only counted when written
+        const detail::detached_instrumentation detached;
+
+        buffer_sink sink(name.size() + 3);
+        detail::write_quoted_string(sink, name.data(), name.size());
+        detail::put(sink, ':');
+        m_rendered.assign(sink.data(), sink.size());
+    }
+
+    const char* data() const
+    {
+        return m_rendered.data();
+    }
+
+    std::size_t size() const
+    {
+        return m_rendered.size();
+    }
+
+    string_ref name() const
+    {
+        return string_ref(m_name.data(), m_name.size());
+    }
+};
+
+namespace detail
+{
+
+// Not constexpr: calling it while building a static_key at compile time
+// makes the compilation fail, while at run time it throws
+inline void static_key_requires_escaping()
+{
+    throw std::invalid_argument("static_key names cannot contain characters needing an escape: use minijson::key instead");
+}
+
+} // namespace detail
+
+// A pre-rendered field name for string literals not needing any escape,
+// built at compile time on C++14 (see make_key)
+template<std::size_t N>
+class static_key
+{
+private:
+
+    char m_rendered[N + 2]; // the N - 1 characters of the name, the quotes and the colon
+
+public:
+
+    MJW_CONSTEXPR14 explicit static_key(const char (&name)[N]) :
+        m_rendered()
+    {
+        m_rendered[0] = '"';
+        for (std::size_t i = 0; i < N - 1; i++)
+        {
+            if (name[i] == '"' || name[i] == '\\' || static_cast<unsigned char>(name[i]) < 32 || name[i] == 127)
+            {
+                detail::static_key_requires_escaping();
+            }
+            m_rendered[i + 1] = name[i];
+        }
+        m_rendered[N] = '"';
+        m_rendered[N + 1] = ':';
+    }
+
+    const char* data() const
+    {
+        return m_rendered;
+    }
+
+    std::size_t size() const
+    {
+        return N + 2;
+    }
+
+    // not escaped, hence the same characters as the rendered name
+    string_ref name() const
+    {
+        return string_ref(m_rendered + 1, N - 1);
+    }
+};
+
+template<std::size_t N>
+MJW_CONSTEXPR14 static_key<N> make_key(const char (&name)[N])
+{
+    return static_key<N>(name);
+}
+
+// What the writers accept as a pre-rendered field name
+class key_ref
+{
+private:
+
+    const char* m_data;
+    std::size_t m_size;
+    string_ref m_name;
+
+public:
+
+    key_ref(const key& k) :
+        m_data(k.data()),
+        m_size(k.size()),
+        m_name(k.name())
+    {
+    }
+
+    template<std::size_t N>
+    key_ref(const static_key<N>& k) :
+        m_data(k.data()),
+        m_size(k.size()),
+        m_name(k.name())
+    {
+    }
+
+    const char* data() const
+    {
+        return m_data;
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    // the unescaped name, for the binary formats
+    const string_ref& name() const
+    {
+        return m_name;
+    }
+};
+
+namespace detail
+{
+
+// The structure and the values of a document are written through the
+// encoder of the sink's format: encoder<typename sink_encoding<Sink>::type>
+template<typename Encoding>
+struct encoder;
+
+template<>
+struct encoder<json_encoding>
+{
+    template<typename Sink>
+    static void open(Sink& sink, bool array)
+    {
+        put(sink, array ? '[' : '{');
+    }
+
+    // called before each element of an array, or each field of an object
+    template<typename Sink>
+    static void element(Sink& sink, bool first)
+    {
+        if (!first)
+        {
+            put(sink, ',');
+        }
+    }
+
+    template<typename Sink>
+    static void close(Sink& sink, bool array)
+    {
+        put(sink, array ? ']' : '}');
+    }
+
+    template<typename Sink>
+    static void field_name(Sink& sink, const string_ref& name)
+    {
+        write_quoted_string(sink, name.data(), name.size());
+        put(sink, ':');
+    }
+
+    template<typename Sink>
+    static void field_name(Sink& sink, const key_ref& name)
+    {
+        write(sink, name.data(), name.size());
+    }
+
+    template<typename Sink>
+    static void null(Sink& sink)
+    {
+        write(sink, "null", 4);
+    }
+
+    template<typename Sink>
+    static void boolean(Sink& sink, bool value)
+    {
+        if (value)
+        {
+            write(sink, "true", 4);
+        }
+        else
+        {
+            write(sink, "false", 5);
+        }
+    }
+
+    template<typename Sink, typename IntegralType>
+    static void integral(Sink& sink, IntegralType value)
+    {
+        write_integral(sink, value);
+    }
+
+    template<typename Sink, typename FloatingPoint>
+    static void floating_point(Sink& sink, FloatingPoint value)
+    {
+        // Numeric values that cannot be represented as sequences of digits
+        // (such as Infinity and NaN) are not permitted in JSON
+        if (!MJW_ISFINITE(value))
+        {
+            null(sink); // falling back to null
+        }
+        else
+        {
+            write_floating_point(sink, value);
+        }
+    }
+
+    template<typename Sink, typename External>
+    static void string(Sink& sink, const char* data, std::size_t size, External external)
+    {
+        write_quoted_string(sink, data, size, external);
+    }
+
+    template<typename Sink>
+    static void binary(Sink& sink, const unsigned char* data, std::size_t size, base64_alphabet alphabet)
+    {
+        write_base64(sink, data, size, alphabet);
+    }
+
+    template<typename Sink>
+    static void raw(Sink& sink, const char* data, std::size_t size)
+    {
+        write(sink, data, size);
+    }
+};
+
+template<typename Sink>
+void write_big_endian(Sink& sink, uint64 value, std::size_t size)
+{
+    char buffer[8];
+    for (std::size_t i = size; i > 0; i--)
+    {
+        buffer[i - 1] = static_cast<char>(value & 0xff);
+        value >>= 8;
+    }
+    write(sink, buffer, size);
+}
+
+template<typename Sink>
+void write_byte(Sink& sink, unsigned byte)
+{
+    put(sink, static_cast<char>(byte));
+}
+
+// float when the value is exactly representable as such, double otherwise
+template<typename Sink, typename FloatingPoint>
+void write_binary_floating_point(Sink& sink, FloatingPoint value, unsigned float_marker, unsigned double_marker)
+{
+    const double as_double = static_cast<double>(value);
+    const float as_float = static_cast<float>(as_double);
+
+    if (static_cast<double>(as_float) == as_double || as_double != as_double)
+    {
+        uint32 bits;
+        std::memcpy(&bits, &as_float, sizeof(bits));
+        write_byte(sink, float_marker);
+        write_big_endian(sink, bits, 4);
+    }
+    else
+    {
+        uint64 bits;
+        std::memcpy(&bits, &as_double, sizeof(bits));
+        write_byte(sink, double_marker);
+        write_big_endian(sink, bits, 8);
+    }
+}
+
+// CBOR (RFC 8949): the containers written by the writers have an
+// indefinite length, ranges of known size a definite one
+template<>
+struct encoder<cbor_encoding>
+{
+    template<typename Sink>
+    static void header(Sink& sink, unsigned major_type, uint64 value)
+    {
+        const unsigned major = major_type << 5;
+
+        if (value < 24)
+        {
+            write_byte(sink, major | static_cast<unsigned>(value));
+        }
+        else if (value <= 0xff)
+        {
+            write_byte(sink, major | 24);
+            write_big_endian(sink, value, 1);
+        }
+        else if (value <= 0xffff)
+        {
+            write_byte(sink, major | 25);
+            write_big_endian(sink, value, 2);
+        }
+        else if (value <= 0xffffffffULL)
+        {
+            write_byte(sink, major | 26);
+            write_big_endian(sink, value, 4);
+        }
+        else
+        {
+            write_byte(sink, major | 27);
+            write_big_endian(sink, value, 8);
+        }
+    }
+
+    template<typename Sink>
+    static void open(Sink& sink, bool array)
+    {
+        write_byte(sink, array ? 0x9f : 0xbf);
+    }
+
+    template<typename Sink>
+    static void element(Sink&, bool)
+    {
+    }
+
+    template<typename Sink>
+    static void close(Sink& sink, bool)
+    {
+        write_byte(sink, 0xff);
+    }
+
+    template<typename Sink>
+    static void begin_array(Sink& sink, std::size_t size)
+    {
+        header(sink, 4, size);
+    }
+
+    template<typename Sink>
+    static void end_array(Sink&)
+    {
+    }
+
+    template<typename Sink>
+    static void field_name(Sink& sink, const string_ref& name)
+    {
+        string(sink, name.data(), name.size(), MJW_LIB_NS::false_type());
+    }
+
+    template<typename Sink>
+    static void field_name(Sink& sink, const key_ref& name)
+    {
+        string(sink, name.name().data(), name.name().size(), MJW_LIB_NS::false_type());
+    }
+
+    template<typename Sink>
+    static void null(Sink& sink)
+    {
+        write_byte(sink, 0xf6);
+    }
+
+    template<typename Sink>
+    static void boolean(Sink& sink, bool value)
+    {
+        write_byte(sink, value ? 0xf5 : 0xf4);
+    }
+
+    template<typename Sink, typename IntegralType>
+    static void integral(Sink& sink, IntegralType value)
+    {
+        if (is_negative(value))
+        {
+            header(sink, 1, absolute_value(value) - 1); // -1 - n
+        }
+        else
+        {
+            header(sink, 0, static_cast<uint64>(value));
+        }
+    }
+
+    // Infinity and NaN are written as such; long double is written as double
+    template<typename Sink, typename FloatingPoint>
+    static void floating_point(Sink& sink, FloatingPoint value)
+    {
+        write_binary_floating_point(sink, value, 0xfa, 0xfb);
+    }
+
+    template<typename Sink, typename External>
+    static void string(Sink& sink, const char* data, std::size_t size, External)
+    {
+        header(sink, 3, size);
+        write(sink, data, size);
+    }
+
+    template<typename Sink>
+    static void binary(Sink& sink, const unsigned char* data, std::size_t size, base64_alphabet)
+    {
+        header(sink, 2, size);
+        write(sink, reinterpret_cast<const char*>(data), size);
+    }
+};
+
+// MessagePack lengths and element counts have at most 32 bits
+inline void check_msgpack_length(std::size_t size)
+{
+    if (static_cast<uint64>(size) > 0xffffffffULL)
+    {
+        throw std::length_error("MessagePack cannot encode lengths of 2^32 or more");
+    }
+}
+
+// MessagePack has no indefinite-length containers: the sink writes 32-bit
+// headers and patches the element count when a container is closed, while
+// ranges of known size get the smallest header
+template<>
+struct encoder<msgpack_encoding>
+{
+    template<typename Sink>
+    static void open(Sink& sink, bool array)
+    {
+        sink.open_container(array);
+    }
+
+    template<typename Sink>
+    static void element(Sink& sink, bool)
+    {
+        sink.count_element();
+    }
+
+    template<typename Sink>
+    static void close(Sink& sink, bool)
+    {
+        sink.close_container();
+    }
+
+    template<typename Sink>
+    static void begin_array(Sink& sink, std::size_t size)
+    {
+        if (size < 16)
+        {
+            write_byte(sink, 0x90 | static_cast<unsigned>(size));
+        }
+        else if (size <= 0xffff)
+        {
+            write_byte(sink, 0xdc);
+            write_big_endian(sink, size, 2);
+        }
+        else
+        {
+            check_msgpack_length(size);
+            write_byte(sink, 0xdd);
+            write_big_endian(sink, size, 4);
+        }
+    }
+
+    template<typename Sink>
+    static void end_array(Sink&)
+    {
+    }
+
+    template<typename Sink>
+    static void field_name(Sink& sink, const string_ref& name)
+    {
+        string(sink, name.data(), name.size(), MJW_LIB_NS::false_type());
+    }
+
+    template<typename Sink>
+    static void field_name(Sink& sink, const key_ref& name)
+    {
+        string(sink, name.name().data(), name.name().size(), MJW_LIB_NS::false_type());
+    }
+
+    template<typename Sink>
+    static void null(Sink& sink)
+    {
+        write_byte(sink, 0xc0);
+    }
+
+    template<typename Sink>
+    static void boolean(Sink& sink, bool value)
+    {
+        write_byte(sink, value ? 0xc3 : 0xc2);
+    }
+
+    template<typename Sink, typename IntegralType>
+    static void integral(Sink& sink, IntegralType value)
+    {
+        if (!is_negative(value))
+        {
+            const uint64 magnitude = static_cast<uint64>(value);
+            if (magnitude < 0x80)
+            {
+                write_byte(sink, static_cast<unsigned>(magnitude));
+            }
+            else if (magnitude <= 0xff)
+            {
+                write_byte(sink, 0xcc);
+                write_big_endian(sink, magnitude, 1);
+            }
+            else if (magnitude <= 0xffff)
+            {
+                write_byte(sink, 0xcd);
+                write_big_endian(sink, magnitude, 2);
+            }
+            else if (magnitude <= 0xffffffffULL)
+            {
+                write_byte(sink, 0xce);
+                write_big_endian(sink, magnitude, 4);
+            }
+            else
+            {
+                write_byte(sink, 0xcf);
+                write_big_endian(sink, magnitude, 8);
+            }
+            return;
+        }
+
+        // two's complement, truncated to the size of the encoding
+        const MJW_LIB_NS::int64_t signed_value = static_cast<MJW_LIB_NS::int64_t>(value);
+        const uint64 bits = static_cast<uint64>(signed_value);
+        if (signed_value >= -32)
+        {
+            write_byte(sink, static_cast<unsigned>(bits & 0xff));
+        }
+        else if (signed_value >= -128)
+        {
+            write_byte(sink, 0xd0);
+            write_big_endian(sink, bits, 1);
+        }
+        else if (signed_value >= -32768)
+        {
+            write_byte(sink, 0xd1);
+            write_big_endian(sink, bits, 2);
+        }
+        else if (signed_value >= -2147483647LL - 1)
+        {
+            write_byte(sink, 0xd2);
+            write_big_endian(sink, bits, 4);
+        }
+        else
+        {
+            write_byte(sink, 0xd3);
+            write_big_endian(sink, bits, 8);
+        }
+    }
+
+    // Infinity and NaN are written as such; long double is written as double
+    template<typename Sink, typename FloatingPoint>
+    static void floating_point(Sink& sink, FloatingPoint value)
+    {
+        write_binary_floating_point(sink, value, 0xca, 0xcb);
+    }
+
+    template<typename Sink, typename External>
+    static void string(Sink& sink, const char* data, std::size_t size, External)
+    {
+        if (size < 32)
+        {
+            write_byte(sink, 0xa0 | static_cast<unsigned>(size));
+        }
+        else if (size <= 0xff)
+        {
+            write_byte(sink, 0xd9);
+            write_big_endian(sink, size, 1);
+        }
+        else if (size <= 0xffff)
+        {
+            write_byte(sink, 0xda);
+            write_big_endian(sink, size, 2);
+        }
+        else
+        {
+            check_msgpack_length(size);
+            write_byte(sink, 0xdb);
+            write_big_endian(sink, size, 4);
+        }
+        write(sink, data, size);
+    }
+
+    template<typename Sink>
+    static void binary(Sink& sink, const unsigned char* data, std::size_t size, base64_alphabet)
+    {
+        if (size <= 0xff)
+        {
+            write_byte(sink, 0xc4);
+            write_big_endian(sink, size, 1);
+        }
+        else if (size <= 0xffff)
+        {
+            write_byte(sink, 0xc5);
+            write_big_endian(sink, size, 2);
+        }
+        else
+        {
+            check_msgpack_length(size);
+            write_byte(sink, 0xc6);
+            write_big_endian(sink, size, 4);
+        }
+        write(sink, reinterpret_cast<const char*>(data), size);
+    }
+};
+
+#if defined(MJW_ENABLE_INSTRUMENTATION)
+// Calls the instrumentation hooks around the encoder's functions
+template<typename Encoder>
+struct instrumented_encoder : public Encoder
+{
+    template<typename Sink>
+    static void open(Sink& sink, bool array)
+    {
+        enter_container<Sink>();
+        Encoder::open(sink, array);
+    }
+
+    template<typename Sink>
+    static void close(Sink& sink, bool array)
+    {
+        Encoder::close(sink, array);
+        leave_container<Sink>();
+    }
+
+    template<typename Sink>
+    static void begin_array(Sink& sink, std::size_t size)
+    {
+        enter_container<Sink>();
+        Encoder::begin_array(sink, size);
+    }
+
+    template<typename Sink>
+    static void end_array(Sink& sink)
+    {
+        Encoder::end_array(sink);
+        leave_container<Sink>();
+    }
+
+    template<typename Sink>
+    static void null(Sink& sink)
+    {
+        count_values<Sink>(NULL_VALUE);
+        Encoder::null(sink);
+    }
+
+    template<typename Sink>
+    static void boolean(Sink& sink, bool value)
+    {
+        count_values<Sink>(BOOLEAN_VALUE);
+        Encoder::boolean(sink, value);
+    }
+
+    template<typename Sink, typename IntegralType>
+    static void integral(Sink& sink, IntegralType value)
+    {
+        count_values<Sink>(INTEGRAL_VALUE);
+        Encoder::integral(sink, value);
+    }
+
+    template<typename Sink, typename FloatingPoint>
+    static void floating_point(Sink& sink, FloatingPoint value)
+    {
+        count_values<Sink>(FLOATING_POINT_VALUE);
+        Encoder::floating_point(sink, value);
+    }
+
+    template<typename Sink, typename External>
+    static void string(Sink& sink, const char* data, std::size_t size, External external)
+    {
+        count_values<Sink>(STRING_VALUE);
+        Encoder::string(sink, data, size, external);
+    }
+
+    template<typename Sink>
+    static void binary(Sink& sink, const unsigned char* data, std::size_t size, base64_alphabet alphabet)
+    {
+        count_values<Sink>(BINARY_VALUE);
+        Encoder::binary(sink, data, size, alphabet);
+    }
+};
+
+template<typename Sink>
+struct encoder_of
+{
+    typedef instrumented_encoder<encoder<typename sink_encoding<Sink>::type> > type;
+};
+#else
+template<typename Sink>
+struct encoder_of
+{
+    typedef encoder<typename sink_encoding<Sink>::type> type;
+};
+#endif
+
+// The values written by minijson's own value writers are counted by type
+// (see writer_stats), the others as custom values
+template<typename V>
+struct is_builtin_value
+{
+    static const bool value =
+        MJW_LIB_NS::is_arithmetic<V>::value ||
+        MJW_LIB_NS::is_same<V, null_t>::value ||
+        MJW_LIB_NS::is_same<V, char*>::value ||
+        MJW_LIB_NS::is_same<V, const char*>::value ||
+        MJW_LIB_NS::is_same<V, string_ref>::value ||
+        MJW_LIB_NS::is_same<V, raw_json>::value ||
+        MJW_LIB_NS::is_same<V, external_string>::value ||
+        MJW_LIB_NS::is_same<V, binary_ref>::value ||
+#if MJW_CPP11_SUPPORTED
+        MJW_LIB_NS::is_same<V, std::nullptr_t>::value ||
+#endif
+#if MJW_CPP17_SUPPORTED
+        MJW_LIB_NS::is_same<V, std::string_view>::value ||
+#endif
+        MJW_LIB_NS::is_same<V, std::string>::value;
+};
+
+template<std::size_t N>
+struct is_builtin_value<char[N]>
+{
+    static const bool value = true;
+};
+
+template<typename V, typename ValueWriter>
+struct is_custom_value_writer
+{
+    static const bool value = true;
+};
+
+template<typename V>
+struct is_custom_value_writer<V, default_value_writer<V> >
+{
+    static const bool value = !is_builtin_value<V>::value;
+};
+
+template<typename V, typename InputIt, typename ValueWriter>
+struct is_custom_value_writer<V, range_writer<InputIt, ValueWriter> >
+{
+    static const bool value = false;
+};
+
+template<typename Sink, typename V, typename ValueWriter>
+void count_custom_value()
+{
+    if (is_custom_value_writer<V, ValueWriter>::value)
+    {
+        count_values<Sink>(CUSTOM_VALUE);
+    }
+}
+
+} // namespace detail
+
+#if defined(MJW_ENABLE_INSTRUMENTATION)
+// The counters of the calling thread; they can be reset by assigning
+// writer_stats() between documents
+inline writer_stats& thread_writer_stats()
+{
+    return detail::instrumentation().totals;
+}
+
+// The callback is called on the writing thread whenever a top-level object
+// or array is closed, with the counters for that document only; NULL
+// removes it
+inline void set_document_callback(document_callback callback)
+{
+    detail::document_callback_slot().store(callback);
+}
+#endif
+
+template<typename Sink>
+class basic_writer
+{
+private:
+
+    enum status
+    {
+        EMPTY,
+        OPEN,
+        CLOSED
+    };
+
+    bool m_array;
+    status m_status;
+    bool m_stream_ready; // the stream settings have been established for the document
+    Sink* m_sink;
+
+    typedef typename detail::encoder_of<Sink>::type encoder;
+
+    void write_opening_bracket()
+    {
+        encoder::open(*m_sink, m_array);
+    }
+
+    void write_closing_bracket()
+    {
+        encoder::close(*m_sink, m_array);
+    }
+
+protected:
+
+    void prepare_stream()
+    {
+        if (m_stream_ready)
+        {
+            detail::restore_stream_flags(*m_sink);
+        }
+        else
+        {
+            detail::establish_stream_settings(*m_sink);
+            m_stream_ready = true;
+        }
+    }
+
+    void next_field()
+    {
+        const bool first = m_status == EMPTY;
+        if (first)
+        {
+            write_opening_bracket();
+        }
+        encoder::element(*m_sink, first);
+
+        m_status = OPEN;
+    }
+
+    void write_field_name(const string_ref& name)
+    {
+        encoder::field_name(*m_sink, name);
+    }
+
+    void write_field_name(const key_ref& name)
+    {
+        encoder::field_name(*m_sink, name);
+    }
+
+    template<typename V, typename ValueWriter>
+    void write_helper(const V& value, ValueWriter value_writer)
+    {
+        if (m_status == CLOSED)
+        {
+            return;
+        }
+
+        prepare_stream();
+
+        next_field();
+
+        detail::count_custom_value<Sink, V, ValueWriter>();
+        value_writer(*m_sink, value);
+    }
+
+    template<typename Name, typename V, typename ValueWriter>
+    void write_helper(const Name& field_name, const V& value, ValueWriter value_writer)
+    {
+        if (m_status == CLOSED)
+        {
+            return;
+        }
+
+        prepare_stream();
+
+        next_field();
+
+        write_field_name(field_name);
+
+        detail::count_custom_value<Sink, V, ValueWriter>();
+        value_writer(*m_sink, value);
+    }
+
+    explicit basic_writer(Sink& sink, bool array, bool stream_ready = false) :
+        m_array(array),
+        m_status(EMPTY),
+        m_stream_ready(stream_ready),
+        m_sink(&sink)
+    {
+    }
+
+public:
+
+    Sink& stream() const
+    {
+        return *m_sink;
+    }
+
+    void close()
+    {
+        if (m_status == CLOSED)
+        {
+            return;
+        }
+
+        prepare_stream();
+
+        if (m_status == EMPTY)
+        {
+            write_opening_bracket();
+        }
+
+        write_closing_bracket();
+
+        m_status = CLOSED;
+    }
+
+};
+
+template<typename Sink>
+class basic_object_writer;
+
+template<typename Sink>
+class basic_array_writer;
+
+template<typename Sink>
+class basic_object_writer : public basic_writer<Sink>
+{
+private:
+
+    friend class basic_array_writer<Sink>;
+
+    // nested writers share the stream settings of the enclosing document
+    basic_object_writer(Sink& sink, bool stream_ready) : basic_writer<Sink>(sink, false, stream_ready)
+    {
+    }
+
+public:
+
+    explicit basic_object_writer(Sink& sink) : basic_writer<Sink>(sink, false)
+    {
+    }
+
+    template<typename V>
+    void write(const string_ref& field_name, const V& value)
+    {
+        this->write_helper(field_name, value, default_value_writer<V>());
+    }
+
+    template<typename V, typename ValueWriter>
+    void write(const string_ref& field_name, const V& value, ValueWriter value_writer)
+    {
+        this->write_helper(field_name, value, value_writer);
+    }
+
+    template<typename InputIt>
+    void write_array(const string_ref& field_name, InputIt begin, InputIt end)
+    {
+        write_array(field_name, begin, end, default_value_writer<typename detail::get_value_type<InputIt>::type>());
+    }
+
+    template<typename InputIt, typename ValueWriter>
+    void write_array(const string_ref& field_name, InputIt begin, InputIt end, ValueWriter value_writer)
+    {
+        write(field_name, detail::make_range(begin, end), detail::range_writer<InputIt, ValueWriter>(value_writer));
+    }
+
+    template<typename V>
+    void write(const key_ref& field_name, const V& value)
+    {
+        this->write_helper(field_name, value, default_value_writer<V>());
+    }
+
+    template<typename V, typename ValueWriter>
+    void write(const key_ref& field_name, const V& value, ValueWriter value_writer)
+    {
+        this->write_helper(field_name, value, value_writer);
+    }
+
+    template<typename InputIt>
+    void write_array(const key_ref& field_name, InputIt begin, InputIt end)
+    {
+        write_array(field_name, begin, end, default_value_writer<typename detail::get_value_type<InputIt>::type>());
+    }
+
+    template<typename InputIt, typename ValueWriter>
+    void write_array(const key_ref& field_name, InputIt begin, InputIt end, ValueWriter value_writer)
+    {
+        write(field_name, detail::make_range(begin, end), detail::range_writer<InputIt, ValueWriter>(value_writer));
+    }
+
+    basic_object_writer<Sink> nested_object(const string_ref& field_name);
+
+    basic_object_writer<Sink> nested_object(const key_ref& field_name);
+
+    basic_array_writer<Sink> nested_array(const string_ref& field_name);
+
+    basic_array_writer<Sink> nested_array(const key_ref& field_name);
+
+};
+
+template<typename Sink>
+class basic_array_writer : public basic_writer<Sink>
+{
+private:
+
+    friend class basic_object_writer<Sink>;
+
+    basic_array_writer(Sink& sink, bool stream_ready) : basic_writer<Sink>(sink, true, stream_ready)
+    {
+    }
+
+public:
+
+    explicit basic_array_writer(Sink& sink) : basic_writer<Sink>(sink, true)
+    {
+    }
+
+    template<typename V>
+    void write(const V& value)
+    {
+        this->write_helper(value, default_value_writer<V>());
+    }
+
+    template<typename V, typename ValueWriter>
+    void write(const V& value, ValueWriter value_writer)
+    {
+        this->write_helper(value, value_writer);
+    }
+
+    template<typename InputIt>
+    void write_array(InputIt begin, InputIt end)
+    {
+        write_array(begin, end, default_value_writer<typename detail::get_value_type<InputIt>::type>());
+    }
+
+    template<typename InputIt, typename ValueWriter>
+    void write_array(InputIt begin, InputIt end, ValueWriter value_writer)
+    {
+        write(detail::make_range(begin, end), detail::range_writer<InputIt, ValueWriter>(value_writer));
+    }
+
+    basic_object_writer<Sink> nested_object();
+
+    basic_array_writer<Sink> nested_array();
+
+};
+
+typedef basic_writer<std::ostream> writer;
+typedef basic_object_writer<std::ostream> object_writer;
+typedef basic_array_writer<std::ostream> array_writer;
+
+template<typename Sink>
+basic_object_writer<Sink> basic_object_writer<Sink>::nested_object(const string_ref& field_name)
+{
+    this->prepare_stream();
+
+    this->next_field();
+    this->write_field_name(field_name);
+
+    return basic_object_writer<Sink>(this->stream(), true);
+}
+
+template<typename Sink>
+basic_array_writer<Sink> basic_object_writer<Sink>::nested_array(const string_ref& field_name)
+{
+    this->prepare_stream();
+
+    this->next_field();
+    this->write_field_name(field_name);
+
+    return basic_array_writer<Sink>(this->stream(), true);
+}
+
+template<typename Sink>
+basic_object_writer<Sink> basic_object_writer<Sink>::nested_object(const key_ref& field_name)
+{
+    this->prepare_stream();
+
+    this->next_field();
+    this->write_field_name(field_name);
+
+    return basic_object_writer<Sink>(this->stream(), true);
+}
+
+template<typename Sink>
+basic_array_writer<Sink> basic_object_writer<Sink>::nested_array(const key_ref& field_name)
+{
+    this->prepare_stream();
+
+    this->next_field();
+    this->write_field_name(field_name);
+
+    return basic_array_writer<Sink>(this->stream(), true);
+}
+
+template<typename Sink>
+basic_object_writer<Sink> basic_array_writer<Sink>::nested_object()
+{
+    this->prepare_stream();
+
+    this->next_field();
+
+    return basic_object_writer<Sink>(this->stream(), true);
+}
+
+template<typename Sink>
+basic_array_writer<Sink> basic_array_writer<Sink>::nested_array()
+{
+    this->prepare_stream();
+
+    this->next_field();
+
+    return basic_array_writer<Sink>(this->stream(), true);
+}
+
+template<>
+struct default_value_writer<null_t>
+{
+    template<typename Sink>
+    void operator()(Sink& sink, null_t) const
+    {
+        detail::encoder_of<Sink>::type::null(sink);
+    }
+};
+
+#if MJW_CPP11_SUPPORTED
+template<>
+struct default_value_writer<std::nullptr_t>
+{
+    template<typename Sink>
+    void operator()(Sink& sink, std::nullptr_t) const
+    {
+        default_value_writer<null_t>()(sink, null);
+    }
+};
+#endif
+
+template<typename IntegralType>
+struct default_value_writer<
+        IntegralType,
+        typename detail::enable_if<MJW_LIB_NS::is_integral<IntegralType>::value && !MJW_LIB_NS::is_same<IntegralType, bool>::value>::type>
+{
+    template<typename Sink>
+    void operator()(Sink& sink, IntegralType value) const
+    {
+        detail::encoder_of<Sink>::type::integral(sink, value);
+    }
+};
+
+template<>
+struct default_value_writer<bool>
+{
+    template<typename Sink>
+    void operator()(Sink& sink, bool value) const
+    {
+        detail::encoder_of<Sink>::type::boolean(sink, value);
+    }
+};
+
+template<typename FloatingPoint>
+struct default_value_writer<
+        FloatingPoint,
+        typename detail::enable_if<MJW_LIB_NS::is_floating_point<FloatingPoint>::value>::type>
+{
+    template<typename Sink>
+    void operator()(Sink& sink, FloatingPoint value) const
+    {
+        detail::encoder_of<Sink>::type::floating_point(sink, value);
+    }
+};
+
+template<>
+struct default_value_writer<char*>
+{
+    template<typename Sink>
+    void operator()(Sink& sink, const char* str) const
+    {
+        detail::encoder_of<Sink>::type::string(sink, str, std::strlen(str), MJW_LIB_NS::false_type());
+    }
+};
+
+template<>
+struct default_value_writer<const char*> : public default_value_writer<char*>
+{
+};
+
+template<size_t N>
+struct default_value_writer<char[N]> : public default_value_writer<char*>
+{
+};
+
+template<size_t N>
+struct default_value_writer<const char[N]> : public default_value_writer<char*>
+{
+};
+
+template<>
+struct default_value_writer<string_ref>
+{
+    template<typename Sink>
+    void operator()(Sink& sink, const string_ref& str) const
+    {
+        detail::encoder_of<Sink>::type::string(sink, str.data(), str.size(), MJW_LIB_NS::false_type());
+    }
+};
+
+template<>
+struct default_value_writer<raw_json>
+{
+    // only available on JSON sinks
+    template<typename Sink>
+    void operator()(Sink& sink, const raw_json& json) const
+    {
+        detail::encoder_of<Sink>::type::raw(sink, json.data(), json.size());
+    }
+};
+
+template<>
+struct default_value_writer<external_string>
+{
+    template<typename Sink>
+    void operator()(Sink& sink, const external_string& str) const
+    {
+        typedef MJW_LIB_NS::integral_constant<bool, detail::has_external_write<Sink>::value> external;
+
+        detail::encoder_of<Sink>::type::string(sink, str.data(), str.size(), external());
+    }
+};
+
+template<>
+struct default_value_writer<binary_ref>
+{
+    template<typename Sink>
+    void operator()(Sink& sink, const binary_ref& value) const
+    {
+        detail::encoder_of<Sink>::type::binary(sink, value.data(), value.size(), value.alphabet());
+    }
+};
+
+template<>
+struct default_value_writer<std::string>
+{
+    template<typename Sink>
+    void operator()(Sink& sink, const std::string& str) const
+    {
+        detail::encoder_of<Sink>::type::string(sink, str.data(), str.size(), MJW_LIB_NS::false_type());
+    }
+};
+
+#if MJW_CPP17_SUPPORTED
+template<>
+struct default_value_writer<std::string_view>
+{
+    template<typename Sink>
+    void operator()(Sink& sink, std::string_view str) const
+    {
+        detail::encoder_of<Sink>::type::string(sink, str.data(), str.size(), MJW_LIB_NS::false_type());
+    }
+};
+#endif
+
+#if MJW_CPP11_SUPPORTED
+namespace detail
+{
+
+// Howard Hinnant's civil_from_days: the proleptic Gregorian date of the day
+// counted from 1970-01-01
+inline void civil_from_days(long long days, long long& year, unsigned& month, unsigned& day)
+{
+    days += 719468;
+    const long long era = (days >= 0 ? days : days - 146096) / 146097;
+    const unsigned day_of_era = static_cast<unsigned>(days - era * 146097);
+    const unsigned year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    const unsigned day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    const unsigned shifted_month = (5 * day_of_year + 2) / 153; // from March
+    day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+    month = shifted_month < 10 ? shifted_month + 3 : shifted_month - 9;
+    year = static_cast<long long>(year_of_era) + era * 400 + (month <= 2);
+}
+
+// Formats value on exactly width digits, padded with zeros
+template<typename Unsigned>
+char* format_padded(char* dest, Unsigned value, std::size_t width)
+{
+    std::memset(dest, '0', width);
+    format_digits(dest + width, value);
+    return dest + width;
+}
+
+// "YYYY-MM-DDTHH:MM:SS" for the second counted from the epoch. The text of
+// the last second formatted on the thread is kept, so that timestamps in
+// the same second are copied, and those in the same day only need the time
+// of the day formatted.
+struct date_time_cache
+{
+    bool valid;
+    long long day;
+    long long second;
+    std::size_t date_length; // "YYYY-MM-DDT"
+    char text[32];
+};
+
+inline std::size_t format_date_time(char* dest, long long second)
+{
+    static thread_local date_time_cache cache;
+
+    const long long day = (second >= 0 ? second : second - 86399) / 86400;
+    if (!cache.valid || day != cache.day)
+    {
+        long long year;
+        unsigned month;
+        unsigned day_of_month;
+        civil_from_days(day, year, month, day_of_month);
+
+        // years outside [0, 9999] get a sign, as ISO 8601 expanded years
+        char* it = cache.text;
+        if (year < 0 || year > 9999)
+        {
+            *it++ = year < 0 ? '-' : '+';
+        }
+        const unsigned long long year_magnitude = absolute_value(year);
+        it = format_padded(it, year_magnitude, std::max<std::size_t>(count_digits(year_magnitude), 4));
+        *it++ = '-';
+        it = format_padded(it, month, 2);
+        *it++ = '-';
+        it = format_padded(it, day_of_month, 2);
+        *it++ = 'T';
+
+        cache.valid = true;
+        cache.day = day;
+        cache.second = second + 1; // the time of the day is formatted below
+        cache.date_length = static_cast<std::size_t>(it - cache.text);
+    }
+
+    if (second != cache.second)
+    {
+        const unsigned second_of_day = static_cast<unsigned>(second - day * 86400);
+        char* it = cache.text + cache.date_length;
+        it = format_padded(it, second_of_day / 3600, 2);
+        *it++ = ':';
+        it = format_padded(it, second_of_day / 60 % 60, 2);
+        *it++ = ':';
+        format_padded(it, second_of_day % 60, 2);
+        cache.second = second;
+    }
+
+    const std::size_t length = cache.date_length + 8;
+    std::memcpy(dest, cache.text, length);
+    return length;
+}
+
+// The duration rounded towards negative infinity
+template<typename To, typename Rep, typename Period>
+To floor_duration(const std::chrono::duration<Rep, Period>& duration)
+{
+    To result = std::chrono::duration_cast<To>(duration);
+    if (result > duration)
+    {
+        result -= To(1);
+    }
+    return result;
+}
+
+// 0, 3, 6 or 9 digits, enough for the precision of Duration
+template<typename Duration>
+struct fraction_digits
+{
+    static const std::size_t value =
+        Duration::period::den == 1 ? 0 :
+        Duration::period::den <= 1000 ? 3 :
+        Duration::period::den <= 1000000 ? 6 : 9;
+};
+
+template<typename Duration>
+std::size_t format_timestamp(char* dest, const std::chrono::time_point<std::chrono::system_clock, Duration>& time)
+{
+    typedef std::chrono::duration<long long, std::ratio<1, 1000000000> > nanoseconds;
+    static const unsigned long long divisors[] = { 1000000000, 1000000, 1000, 1 };
+    const std::size_t digits = fraction_digits<Duration>::value;
+
+    const std::chrono::seconds second = floor_duration<std::chrono::seconds>(time.time_since_epoch());
+
+    char* it = dest + format_date_time(dest, second.count());
+    if (digits > 0)
+    {
+        // less than a second: never overflows
+        const nanoseconds fraction_duration = std::chrono::duration_cast<nanoseconds>(time.time_since_epoch() - second);
+        const unsigned long long fraction = static_cast<unsigned long long>(fraction_duration.count());
+        *it++ = '.';
+        it = format_padded(it, fraction / divisors[digits / 3], digits);
+    }
+    *it++ = 'Z';
+    return static_cast<std::size_t>(it - dest);
+}
+
+} // namespace detail
+
+// system_clock time points are written as ISO 8601 UTC timestamps, e.g.
+// "2024-05-17T08:30:00.250Z", with 0, 3, 6 or 9 decimals depending on the
+// precision of their duration: use std::chrono::time_point_cast, or
+// timestamp_writer, to choose it.
+template<typename Duration>
+struct default_value_writer<std::chrono::time_point<std::chrono::system_clock, Duration> >
+{
+    template<typename Sink>
+    void operator()(Sink& sink, const std::chrono::time_point<std::chrono::system_clock, Duration>& time) const
+    {
+        char buffer[48];
+        const std::size_t length = detail::format_timestamp(buffer, time);
+        detail::encoder_of<Sink>::type::string(sink, buffer, length, MJW_LIB_NS::false_type());
+    }
+};
+
+// Writes system_clock time points as ISO 8601 timestamps with the
+// precision of Precision (e.g. std::chrono::milliseconds), truncating
+template<typename Precision>
+struct timestamp_writer
+{
+    template<typename Sink, typename Duration>
+    void operator()(Sink& sink, const std::chrono::time_point<std::chrono::system_clock, Duration>& time) const
+    {
+        typedef std::chrono::time_point<std::chrono::system_clock, Precision> precise_time;
+        default_value_writer<precise_time>()(sink, precise_time(detail::floor_duration<Precision>(time.time_since_epoch())));
+    }
+};
+
+// Writes system_clock time points as the number of Precision units since
+// the epoch (e.g. milliseconds), truncating
+template<typename Precision>
+struct epoch_writer
+{
+    template<typename Sink, typename Duration>
+    void operator()(Sink& sink, const std::chrono::time_point<std::chrono::system_clock, Duration>& time) const
+    {
+        detail::encoder_of<Sink>::type::integral(sink, detail::floor_duration<Precision>(time.time_since_epoch()).count());
+    }
+};
+
+namespace detail
+{
+
+template<typename Duration>
+struct is_builtin_value<std::chrono::time_point<std::chrono::system_clock, Duration> >
+{
+    static const bool value = true;
+};
+
+template<typename V, typename Precision>
+struct is_custom_value_writer<V, timestamp_writer<Precision> >
+{
+    static const bool value = false;
+};
+
+template<typename V, typename Precision>
+struct is_custom_value_writer<V, epoch_writer<Precision> >
+{
+    static const bool value = false;
+};
+
+} // namespace detail
+#endif // MJW_CPP11_SUPPORTED
+
+template<typename Sink, typename InputIt>
+void write_array(Sink& sink, InputIt begin, InputIt end)
+{
+    write_array(sink, begin, end, default_value_writer<typename detail::get_value_type<InputIt>::type>());
+}
+
+namespace detail
+{
+
+// Contiguous ranges of numbers (pointers and std::vector iterators) written
+// with default_value_writer are formatted in bulk by write_array
+template<typename InputIt, typename ValueWriter, bool = MJW_LIB_NS::is_arithmetic<typename get_value_type<InputIt>::type>::value>
+struct is_number_span
+{
+    static const bool value = false;
+};
+
+template<typename InputIt, typename ValueWriter>
+struct is_number_span<InputIt, ValueWriter, true>
+{
+    typedef typename get_value_type<InputIt>::type value_type;
+
+    static const bool value =
+        !MJW_LIB_NS::is_same<value_type, bool>::value &&
+        MJW_LIB_NS::is_same<ValueWriter, default_value_writer<value_type> >::value &&
+        (MJW_LIB_NS::is_pointer<InputIt>::value ||
+         MJW_LIB_NS::is_same<InputIt, typename std::vector<value_type>::iterator>::value ||
+         MJW_LIB_NS::is_same<InputIt, typename std::vector<value_type>::const_iterator>::value);
+};
+
+template<typename Number>
+struct max_number_length
+{
+    static const std::size_t value =
+        MJW_LIB_NS::is_integral<Number>::value ? max_integral_length<Number>::value : max_floating_point_length;
+};
+
+template<typename IntegralType>
+typename enable_if<MJW_LIB_NS::is_integral<IntegralType>::value, std::size_t>::type format_number(char* dest, IntegralType value)
+{
+    return format_integral(dest, value);
+}
+
+template<typename FloatingPoint>
+typename enable_if<MJW_LIB_NS::is_floating_point<FloatingPoint>::value, std::size_t>::type format_number(char* dest, FloatingPoint value)
+{
+    if (!MJW_ISFINITE(value))
+    {
+        std::memcpy(dest, "null", 4);
+        return 4;
+    }
+
+    return format_floating_point(dest, value);
+}
+
+template<typename Number, typename Sink>
+typename enable_if<MJW_LIB_NS::is_integral<Number>::value, bool>::type can_format_in_bulk(const Sink&)
+{
+    return true;
+}
+
+template<typename Number, typename Sink>
+typename enable_if<MJW_LIB_NS::is_floating_point<Number>::value, bool>::type can_format_in_bulk(Sink& sink)
+{
+    return uses_shortest_format(sink);
+}
+
+// Formats the numbers a block at a time, into room reserved in the sink when
+// it has direct access and into a local buffer otherwise
+template<typename Sink, typename Number>
+void write_numbers(Sink& sink, const Number* begin, const Number* end)
+{
+    const std::size_t block_size = 64;
+    const std::size_t element_length = max_number_length<Number>::value + 1; // with the separator
+    char buffer[block_size * element_length];
+
+    enter_container<Sink>();
+    count_values<Sink>(MJW_LIB_NS::is_integral<Number>::value ? INTEGRAL_VALUE : FLOATING_POINT_VALUE, static_cast<std::size_t>(end - begin));
+    put(sink, '[');
+
+    for (const Number* it = begin; it != end;)
+    {
+        const std::size_t count = std::min<std::size_t>(block_size, end - it);
+        char* const block = begin_block(sink, count * element_length, buffer);
+        char* dest = block;
+
+        for (const Number* const block_end = it + count; it != block_end; ++it)
+        {
+            // the separator is always stored, but only kept after the first element
+            *dest = ',';
+            dest += it != begin;
+            dest += format_number(dest, *it);
+        }
+
+        end_block(sink, block, static_cast<std::size_t>(dest - block));
+    }
+
+    put(sink, ']');
+    leave_container<Sink>();
+}
+
+// How write_array writes a range
+struct generic_elements
+{
+};
+
+struct number_span_elements
+{
+};
+
+struct counted_elements
+{
+};
+
+template<typename Sink, typename InputIt, typename ValueWriter>
+struct elements_strategy
+{
+    typedef typename MJW_LIB_NS::conditional<
+        is_json_sink<Sink>::value,
+        typename MJW_LIB_NS::conditional<is_number_span<InputIt, ValueWriter>::value, number_span_elements, generic_elements>::type,
+        // binary formats write the number of elements first, if it is known
+        typename MJW_LIB_NS::conditional<
+            MJW_LIB_NS::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<InputIt>::iterator_category>::value,
+            counted_elements,
+            generic_elements>::type>::type type;
+};
+
+template<typename Sink, typename InputIt, typename ValueWriter>
+void write_elements(Sink& sink, InputIt begin, InputIt end, ValueWriter value_writer, generic_elements)
+{
+    basic_array_writer<Sink> writer(sink);
+
+    for (InputIt it = begin; it != end; ++it)
+    {
+        writer.write(*it, value_writer);
+    }
+
+    writer.close();
+}
+
+template<typename Sink, typename InputIt, typename ValueWriter>
+void write_elements(Sink& sink, InputIt begin, InputIt end, ValueWriter value_writer, number_span_elements)
+{
+    typedef typename get_value_type<InputIt>::type value_type;
+
+    if (begin == end || !can_format_in_bulk<value_type>(sink))
+    {
+        write_elements(sink, begin, end, value_writer, generic_elements());
+        return;
+    }
+
+    const value_type* const first = &*begin;
+    write_numbers(sink, first, first + (end - begin));
+}
+
+template<typename Sink, typename InputIt, typename ValueWriter>
+void write_elements(Sink& sink, InputIt begin, InputIt end, ValueWriter value_writer, counted_elements)
+{
+    typedef typename encoder_of<Sink>::type encoder;
+
+    encoder::begin_array(sink, static_cast<std::size_t>(std::distance(begin, end)));
+
+    for (InputIt it = begin; it != end; ++it)
+    {
+        count_custom_value<Sink, typename get_value_type<InputIt>::type, ValueWriter>();
+        value_writer(sink, *it);
+    }
+
+    encoder::end_array(sink);
+}
+
+} // namespace detail
+
+template<typename Sink, typename InputIt, typename ValueWriter>
+void write_array(Sink& sink, InputIt begin, InputIt end, ValueWriter value_writer)
+{
+    detail::write_elements(sink, begin, end, value_writer, typename detail::elements_strategy<Sink, InputIt, ValueWriter>::type());
+}
+
+namespace detail
+{
+
+// Sinks may also expose flush(), pushing buffered output further down
+template<typename Sink>
+struct has_flush
+{
+    typedef char yes;
+    typedef char (&no)[2];
+
+    template<typename U, void (U::*)()>
+    struct check;
+
+    template<typename U>
+    static yes test(check<U, &U::flush>*);
+
+    template<typename U>
+    static no test(...);
+
+    static const bool value = sizeof(test<Sink>(NULL)) == sizeof(yes);
+};
+
+template<typename Stream>
+typename enable_if<is_ostream<Stream>::value>::type flush_sink(Stream& stream)
+{
+    stream.flush();
+}
+
+template<typename Sink>
+typename enable_if<!is_ostream<Sink>::value && has_flush<Sink>::value>::type flush_sink(Sink& sink)
+{
+    sink.flush();
+}
+
+template<typename Sink>
+typename enable_if<!is_ostream<Sink>::value && !has_flush<Sink>::value>::type flush_sink(Sink&)
+{
+}
+
+} // namespace detail
+
+// Writes a stream of newline-delimited JSON records (NDJSON). Records are
+// serialised into a batch buffer, reused from one record to the next, and
+// the batch is written to the sink in one go when it holds max_records
+// records or max_bytes bytes, or (C++11) when its oldest record has waited
+// max_delay. The sink is then flushed, if it can be. The delay is only
+// checked when records are committed: call flush_if_due() when idle.
+//
+//   minijson::ndjson_writer<std::ostream> records(stream);
+//   minijson::basic_object_writer<minijson::buffer_sink> writer = records.object();
+//   writer.write("level", "info");
+//   writer.close();
+//   unsigned long long offset = records.commit();
+template<typename Sink>
+class ndjson_writer
+{
+public:
+
+    struct options
+    {
+        std::size_t max_records;
+        std::size_t max_bytes;
+#if MJW_CPP11_SUPPORTED
+        std::chrono::milliseconds max_delay;
+#endif
+
+        options() :
+            max_records(1000),
+            max_bytes(64 * 1024)
+#if MJW_CPP11_SUPPORTED
+            , max_delay(1000)
+#endif
+        {
+        }
+    };
+
+private:
+
+    Sink* m_sink;
+    options m_options;
+    buffer_sink m_batch;
+    std::size_t m_committed; // size of the committed records in the batch
+    std::size_t m_batch_records;
+    unsigned long long m_written; // bytes written to the sink
+    unsigned long long m_records;
+#if MJW_CPP11_SUPPORTED
+    std::chrono::steady_clock::time_point m_batch_start;
+#endif
+
+    ndjson_writer(const ndjson_writer&);
+    ndjson_writer& operator=(const ndjson_writer&);
+
+    bool due() const
+    {
+        if (m_batch_records >= m_options.max_records || m_committed >= m_options.max_bytes)
+        {
+            return true;
+        }
+#if MJW_CPP11_SUPPORTED
+        return m_batch_records > 0 && std::chrono::steady_clock::now() - m_batch_start >= m_options.max_delay;
+#else
+        return false;
+#endif
+    }
+
+public:
+
+    explicit ndjson_writer(Sink& sink, const options& opts = options()) :
+        m_sink(&sink),
+        m_options(opts),
+        m_batch(opts.max_bytes + opts.max_bytes / 4),
+        m_committed(0),
+        m_batch_records(0),
+        m_written(0),
+        m_records(0)
+    {
+    }
+
+    // an uncommitted record is discarded
+    ~ndjson_writer()
+    {
+        flush();
+    }
+
+    // The record being written: close the writer, then commit()
+    basic_object_writer<buffer_sink> object()
+    {
+        return basic_object_writer<buffer_sink>(m_batch);
+    }
+
+    basic_array_writer<buffer_sink> array()
+    {
+        return basic_array_writer<buffer_sink>(m_batch);
+    }
+
+    // Writes value as a whole record and commits it
+    template<typename V>
+    unsigned long long write(const V& value)
+    {
+        return write(value, default_value_writer<V>());
+    }
+
+    template<typename V, typename ValueWriter>
+    unsigned long long write(const V& value, ValueWriter value_writer)
+    {
+        value_writer(m_batch, value);
+        return commit();
+    }
+
+    // Appends the delimiter to the record written since the last commit and
+    // returns its offset in the stream (the number of bytes written before
+    // it), for indexing. The batch is then written if a policy says so.
+    unsigned long long commit()
+    {
+        const unsigned long long offset = m_written + m_committed;
+        m_batch.put('\n');
+#if MJW_CPP11_SUPPORTED
+        if (m_batch_records == 0)
+        {
+            m_batch_start = std::chrono::steady_clock::now();
+        }
+#endif
+        m_committed = m_batch.size();
+        m_batch_records++;
+        m_records++;
+        if (due())
+        {
+            flush();
+        }
+        return offset;
+    }
+
+    // Writes the committed records to the sink and flushes it; a record
+    // being written stays in the batch
+    void flush()
+    {
+        if (m_batch_records == 0)
+        {
+            return;
+        }
+        detail::forward_write(*m_sink, m_batch.data(), m_committed);
+        m_written += m_committed;
+
+        const std::size_t pending = m_batch.size() - m_committed;
+        char* const begin = m_batch.data();
+        std::memmove(begin, begin + m_committed, pending);
+        m_batch.clear();
+        m_batch.commit(pending);
+
+        m_committed = 0;
+        m_batch_records = 0;
+        detail::flush_sink(*m_sink);
+    }
+
+    void flush_if_due()
+    {
+        if (due())
+        {
+            flush();
+        }
+    }
+
+    // Offset of the next record
+    unsigned long long offset() const
+    {
+        return m_written + m_committed;
+    }
+
+    unsigned long long records() const
+    {
+        return m_records;
+    }
+
+    // Records waiting in the batch
+    std::size_t pending_records() const
+    {
+        return m_batch_records;
+    }
+
+    Sink& sink()
+    {
+        return *m_sink;
+    }
+};
+
+#if MJW_CPP11_SUPPORTED
+// Builders for documents whose shape is known at compile time. The position
+// in the document (first element or not, object or array, enclosing
+// builders) is part of the builder's type, so that separators and brackets
+// are written without any runtime check. Every method can only be called on
+// an rvalue and returns the builder for the next position: a document is
+// written as a single chained expression, and writing a field in an array,
+// or anything after the top-level close(), does not compile. Builders are
+// neither copyable nor publicly movable; before C++17 they cannot even be
+// stored in a variable.
+//
+//   minijson::build_object(sink).field("id", 42).array("tags").value("a").close().close();
+
+template<typename Sink>
+class static_end;
+
+template<typename Sink, typename Parent, bool First>
+class static_object;
+
+template<typename Sink, typename Parent, bool First>
+class static_array;
+
+template<typename Sink>
+static_object<Sink, static_end<Sink>, true> build_object(Sink& sink);
+
+template<typename Sink>
+static_array<Sink, static_end<Sink>, true> build_array(Sink& sink);
+
+// Returned by the top-level close(): nothing else can be written
+template<typename Sink>
+class static_end
+{
+private:
+
+    template<typename, typename, bool> friend class static_object;
+    template<typename, typename, bool> friend class static_array;
+
+    explicit static_end(Sink&)
+    {
+    }
+};
+
+template<typename Sink, typename Parent, bool First>
+class static_object
+{
+private:
+
+    typedef static_object<Sink, Parent, false> next;
+    typedef typename detail::encoder_of<Sink>::type encoder;
+
+    Sink* m_sink;
+
+    template<typename, typename, bool> friend class static_object;
+    template<typename, typename, bool> friend class static_array;
+    friend static_object<Sink, static_end<Sink>, true> build_object<Sink>(Sink&);
+
+    explicit static_object(Sink& sink) :
+        m_sink(&sink)
+    {
+    }
+
+    // only the builders can move a builder, when returning the next one
+    static_object(static_object&&) = default;
+    static_object(const static_object&) = delete;
+    static_object& operator=(const static_object&) = delete;
+    static_object& operator=(static_object&&) = delete;
+
+    template<typename Name>
+    void write_field_name(const Name& name)
+    {
+        encoder::element(*m_sink, First);
+        encoder::field_name(*m_sink, name);
+    }
+
+public:
+
+    // the name can be anything string_ref or key_ref can be built from
+    template<typename Name, typename V, typename ValueWriter>
+    next field(const Name& name, const V& value, ValueWriter value_writer) &&
+    {
+        write_field_name(name);
+        detail::count_custom_value<Sink, V, ValueWriter>();
+        value_writer(*m_sink, value);
+        return next(*m_sink);
+    }
+
+    template<typename Name, typename V>
+    next field(const Name& name, const V& value) &&
+    {
+        return std::move(*this).field(name, value, default_value_writer<V>());
+    }
+
+    template<typename Name>
+    static_object<Sink, next, true> object(const Name& name) &&
+    {
+        write_field_name(name);
+        encoder::open(*m_sink, false);
+        return static_object<Sink, next, true>(*m_sink);
+    }
+
+    template<typename Name>
+    static_array<Sink, next, true> array(const Name& name) &&
+    {
+        write_field_name(name);
+        encoder::open(*m_sink, true);
+        return static_array<Sink, next, true>(*m_sink);
+    }
+
+    Parent close() &&
+    {
+        encoder::close(*m_sink, false);
+        return Parent(*m_sink);
+    }
+};
+
+template<typename Sink, typename Parent, bool First>
+class static_array
+{
+private:
+
+    typedef static_array<Sink, Parent, false> next;
+    typedef typename detail::encoder_of<Sink>::type encoder;
+
+    Sink* m_sink;
+
+    template<typename, typename, bool> friend class static_object;
+    template<typename, typename, bool> friend class static_array;
+    friend static_array<Sink, static_end<Sink>, true> build_array<Sink>(Sink&);
+
+    explicit static_array(Sink& sink) :
+        m_sink(&sink)
+    {
+    }
+
+    // only the builders can move a builder, when returning the next one
+    static_array(static_array&&) = default;
+    static_array(const static_array&) = delete;
+    static_array& operator=(const static_array&) = delete;
+    static_array& operator=(static_array&&) = delete;
+
+public:
+
+    template<typename V, typename ValueWriter>
+    next value(const V& value, ValueWriter value_writer) &&
+    {
+        encoder::element(*m_sink, First);
+        detail::count_custom_value<Sink, V, ValueWriter>();
+        value_writer(*m_sink, value);
+        return next(*m_sink);
+    }
+
+    template<typename V>
+    next value(const V& value) &&
+    {
+        return std::move(*this).value(value, default_value_writer<V>());
+    }
+
+    static_object<Sink, next, true> object() &&
+    {
+        encoder::element(*m_sink, First);
+        encoder::open(*m_sink, false);
+        return static_object<Sink, next, true>(*m_sink);
+    }
 
-    explicit range_writer(ValueWriter value_writer) :
-        m_value_writer(value_writer)
+    static_array<Sink, next, true> array() &&
     {
+        encoder::element(*m_sink, First);
+        encoder::open(*m_sink, true);
+        return static_array<Sink, next, true>(*m_sink);
     }
 
-    void operator()(std::ostream& stream, const range<InputIt>& range) const
+    Parent close() &&
     {
-        write_array(stream, range.begin, range.end, m_value_writer);
+        encoder::close(*m_sink, true);
+        return Parent(*m_sink);
     }
 };
 
-} // namespace detail
+// The stream settings are adjusted once, when the builder is created
+template<typename Sink>
+static_object<Sink, static_end<Sink>, true> build_object(Sink& sink)
+{
+    detail::establish_stream_settings(sink);
+    detail::encoder_of<Sink>::type::open(sink, false);
+    return static_object<Sink, static_end<Sink>, true>(sink);
+}
+
+template<typename Sink>
+static_array<Sink, static_end<Sink>, true> build_array(Sink& sink)
+{
+    detail::establish_stream_settings(sink);
+    detail::encoder_of<Sink>::type::open(sink, true);
+    return static_array<Sink, static_end<Sink>, true>(sink);
+}
+#endif // MJW_CPP11_SUPPORTED
 
-class writer
+#if MJW_CPP11_SUPPORTED
+// A fixed set of worker threads running batches of indexed tasks, used by
+// parallel_write_array. A pool runs one batch at a time.
+class thread_pool
 {
 private:
 
-    enum status
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_run_mutex; // serialises the calls to run()
+    std::mutex m_mutex;
+    std::condition_variable m_work_available;
+    std::condition_variable m_work_done;
+
+    std::function<void(std::size_t)> m_task;
+    std::size_t m_task_count;
+    std::atomic<std::size_t> m_next_task;
+    unsigned long m_generation;
+    unsigned m_active_workers;
+    bool m_stopping;
+    std::exception_ptr m_exception;
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    // the pool whose tasks the calling thread is running, if any
+    static const thread_pool*& current_pool()
     {
-        EMPTY,
-        OPEN,
-        CLOSED
-    };
+        static thread_local const thread_pool* pool = nullptr;
+        return pool;
+    }
 
-    bool m_array;
-    status m_status;
-    std::ostream* m_stream;
+    void run_tasks()
+    {
+        const thread_pool* const previous_pool = current_pool();
+        current_pool() = this;
+        run_task_loop();
+        current_pool() = previous_pool;
+    }
 
-    void write_opening_bracket()
+    void run_task_loop()
     {
-        if (m_array)
+        try
         {
-            *m_stream << '[';
+            for (;;)
+            {
+                const std::size_t index = m_next_task.fetch_add(1);
+                if (index >= m_task_count)
+                {
+                    break;
+                }
+                m_task(index);
+            }
         }
-        else
+        catch (...)
         {
-            *m_stream << '{';
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_exception)
+            {
+                m_exception = std::current_exception();
+            }
+            m_next_task.store(m_task_count); // the remaining tasks are skipped
         }
     }
 
-    void write_closing_bracket()
+    void work()
     {
-        if (m_array)
-        {
-            *m_stream << ']';
-        }
-        else
+        unsigned long generation = 0;
+
+        for (;;)
         {
-            *m_stream << '}';
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_work_available.wait(lock, [&]() { return m_stopping || m_generation != generation; });
+                if (m_stopping)
+                {
+                    return;
+                }
+                generation = m_generation;
+            }
+
+            run_tasks();
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_active_workers == 0)
+            {
+                m_work_done.notify_one();
+            }
         }
     }
 
-protected:
+public:
 
-    void next_field()
+    // thread_count includes the thread calling run(); 0 means one per core
+    explicit thread_pool(unsigned thread_count = 0) :
+        m_task_count(0),
+        m_next_task(0),
+        m_generation(0),
+        m_active_workers(0),
+        m_stopping(false)
     {
-        if (m_status == EMPTY)
+        if (thread_count == 0)
         {
-            write_opening_bracket();
+            thread_count = std::max(1u, std::thread::hardware_concurrency());
         }
-        else if (m_status == OPEN)
+        for (unsigned i = 1; i < thread_count; i++)
         {
-            *m_stream << ',';
+            m_threads.push_back(std::thread(&thread_pool::work, this));
         }
-
-        m_status = OPEN;
     }
 
-    void write_field_name(const char* name)
+    ~thread_pool()
     {
-        detail::write_quoted_string(*m_stream, name);
-
-        *m_stream << ':';
-    }
-
-    template<typename V, typename ValueWriter>
-    void write_helper(const char* field_name, const V& value, ValueWriter value_writer)
-    {
-        if (m_status == CLOSED)
         {
-            return;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
         }
-
-        detail::adjust_stream_settings(*m_stream);
-
-        next_field();
-
-        if (field_name != NULL)
+        m_work_available.notify_all();
+        for (std::size_t i = 0; i < m_threads.size(); i++)
         {
-            write_field_name(field_name);
+            m_threads[i].join();
         }
-
-        value_writer(*m_stream, value);
-    }
-
-    explicit writer(std::ostream& stream, bool array) :
-        m_array(array),
-        m_status(EMPTY),
-        m_stream(&stream)
-    {
     }
 
-public:
-
-    std::ostream& stream() const
+    unsigned size() const
     {
-        return *m_stream;
+        return static_cast<unsigned>(m_threads.size() + 1);
     }
 
-    void close()
+    // Calls task(i) for every i in [0, task_count), on the workers and on the
+    // calling thread, and returns when all are done. The first exception
+    // thrown by a task is rethrown. A task calling run() on its own pool
+    // would wait for itself: the nested tasks run serially on its thread.
+    template<typename Task>
+    void run(std::size_t task_count, Task task)
     {
-        if (m_status == CLOSED)
+        if (current_pool() == this)
         {
+            for (std::size_t i = 0; i < task_count; i++)
+            {
+                task(i);
+            }
             return;
         }
 
-        detail::adjust_stream_settings(*m_stream);
+        std::lock_guard<std::mutex> run_lock(m_run_mutex);
 
-        if (m_status == EMPTY)
         {
-            write_opening_bracket();
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_task = task;
+            m_task_count = task_count;
+            m_next_task.store(0);
+            m_active_workers = static_cast<unsigned>(m_threads.size());
+            m_exception = nullptr;
+            m_generation++;
         }
+        m_work_available.notify_all();
 
-        write_closing_bracket();
+        run_tasks();
 
-        m_status = CLOSED;
+        std::exception_ptr exception;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_work_done.wait(lock, [&]() { return m_active_workers == 0; });
+            m_task = nullptr;
+            exception = m_exception;
+        }
+        if (exception)
+        {
+            std::rethrow_exception(exception);
+        }
     }
-
 };
 
-class object_writer;
-class array_writer;
+namespace detail
+{
 
-class object_writer : public writer
+// Lets std::ostream value writers write into a buffer_sink
+class sink_streambuf : public std::streambuf
 {
-public:
+private:
 
-    explicit object_writer(std::ostream& stream) : writer(stream, false)
+    buffer_sink& m_sink;
+
+protected:
+
+    virtual int_type overflow(int_type c)
     {
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            m_sink.put(traits_type::to_char_type(c));
+        }
+        return traits_type::not_eof(c);
     }
 
-    template<typename V>
-    void write(const char* field_name, const V& value)
+    virtual std::streamsize xsputn(const char* data, std::streamsize size)
     {
-        write_helper(field_name, value, default_value_writer<V>());
+        m_sink.write(data, static_cast<std::size_t>(size));
+        return size;
     }
 
-    template<typename V, typename ValueWriter>
-    void write(const char* field_name, const V& value, ValueWriter value_writer)
+public:
+
+    explicit sink_streambuf(buffer_sink& sink) : m_sink(sink)
     {
-        write_helper(field_name, value, value_writer);
     }
+};
 
-    template<typename InputIt>
-    void write_array(const char* field_name, InputIt begin, InputIt end)
+// Where a chunk of a parallel array is formatted: a buffer_sink, or a
+// stream over a buffer_sink with the formatting settings of the target
+// stream, so that the output is the same as the serial one
+template<typename Sink, typename Enable = void>
+class chunk_buffer
+{
+private:
+
+    buffer_sink m_buffer;
+
+public:
+
+    explicit chunk_buffer(const Sink&)
     {
-        write_array(field_name, begin, end, default_value_writer<typename detail::get_value_type<InputIt>::type>());
     }
 
-    template<typename InputIt, typename ValueWriter>
-    void write_array(const char* field_name, InputIt begin, InputIt end, ValueWriter value_writer)
+    buffer_sink& sink()
     {
-        write(field_name, detail::make_range(begin, end), detail::range_writer<InputIt, ValueWriter>(value_writer));
+        return m_buffer;
     }
 
-    object_writer nested_object(const char* field_name);
-
-    array_writer nested_array(const char* field_name);
-
+    buffer_sink& buffer()
+    {
+        return m_buffer;
+    }
 };
 
-class array_writer : public writer
+template<typename Stream>
+class chunk_buffer<Stream, typename enable_if<is_ostream<Stream>::value>::type>
 {
+private:
+
+    buffer_sink m_buffer;
+    sink_streambuf m_streambuf;
+    std::ostream m_stream;
+
 public:
 
-    explicit array_writer(std::ostream& stream) : writer(stream, true)
+    // the settings of the target stream must have been established
+    explicit chunk_buffer(Stream& target) :
+        m_streambuf(m_buffer),
+        m_stream(&m_streambuf)
     {
+        m_stream.imbue(std::locale::classic());
+        m_stream.flags(target.flags());
+        m_stream.precision(target.precision());
+        m_stream.iword(stream_precision_index()) = target.iword(stream_precision_index());
     }
 
-    template<typename V>
-    void write(const V& value)
+    std::ostream& sink()
     {
-        write_helper(NULL, value, default_value_writer<V>());
+        return m_stream;
     }
 
-    template<typename V, typename ValueWriter>
-    void write(const V& value, ValueWriter value_writer)
+    buffer_sink& buffer()
     {
-        write_helper(NULL, value, value_writer);
+        return m_buffer;
     }
+};
 
-    template<typename InputIt>
-    void write_array(InputIt begin, InputIt end)
+template<typename Sink, typename RandomIt, typename ValueWriter>
+void write_parallel_elements(thread_pool& pool, Sink& sink, RandomIt begin, RandomIt end, ValueWriter value_writer)
+{
+    typedef chunk_buffer<Sink> chunk;
+
+    const std::size_t size = static_cast<std::size_t>(end - begin);
+    const std::size_t chunk_size = std::max<std::size_t>(1024, size / (pool.size() * 16));
+    const std::size_t chunk_count = (size + chunk_size - 1) / chunk_size;
+
+    // the chunks are formatted in waves, so that only the output of one wave is buffered
+    const std::size_t wave_size = std::min<std::size_t>(chunk_count, pool.size() * 4);
+    std::vector<std::unique_ptr<chunk> > chunks;
+    for (std::size_t i = 0; i < wave_size; i++)
     {
-        write_array(begin, end, default_value_writer<typename detail::get_value_type<InputIt>::type>());
+        chunks.push_back(std::unique_ptr<chunk>(new chunk(sink)));
     }
+    // what the threads count while formatting the chunks
+    std::vector<detached_stats> chunk_stats(wave_size);
 
-    template<typename InputIt, typename ValueWriter>
-    void write_array(InputIt begin, InputIt end, ValueWriter value_writer)
+    for (std::size_t wave_begin = 0; wave_begin < chunk_count; wave_begin += wave_size)
     {
-        write(detail::make_range(begin, end), detail::range_writer<InputIt, ValueWriter>(value_writer));
-    }
+        const std::size_t wave_end = std::min(chunk_count, wave_begin + wave_size);
+
+        pool.run(wave_end - wave_begin, [&](std::size_t i)
+        {
+            chunk& c = *chunks[i];
+            c.buffer().clear();
+            const detached_instrumentation detached;
 
-    object_writer nested_object();
+            const std::size_t first = (wave_begin + i) * chunk_size;
+            const std::size_t last = std::min(size, first + chunk_size);
+            for (std::size_t j = first; j < last; j++)
+            {
+                if (j > 0)
+                {
+                    put(c.sink(), ',');
+                }
+                count_custom_value<Sink, typename get_value_type<RandomIt>::type, ValueWriter>();
+                value_writer(c.sink(), begin[j]);
+            }
+            chunk_stats[i] = detached.stats();
+        });
 
-    array_writer nested_array();
+        for (std::size_t i = 0; i < wave_end - wave_begin; i++)
+        {
+            attach_instrumentation<Sink>(chunk_stats[i]);
+            write(sink, chunks[i]->buffer().data(), chunks[i]->buffer().size());
+        }
+    }
+}
 
-};
+} // namespace detail
 
-inline object_writer object_writer::nested_object(const char* field_name)
+// Same output as write_array, with the elements formatted on the threads of
+// the pool; the value writer is called concurrently. A value writer for a
+// std::ostream is passed a stream with the formatting settings of the target.
+template<typename Sink, typename RandomIt, typename ValueWriter>
+void parallel_write_array(thread_pool& pool, Sink& sink, RandomIt begin, RandomIt end, ValueWriter value_writer)
 {
-    detail::adjust_stream_settings(stream());
+    static_assert(MJW_LIB_NS::is_base_of<std::random_access_iterator_tag, typename std::iterator_traits<RandomIt>::iterator_category>::value,
+        "parallel_write_array requires random-access iterators");
 
-    next_field();
-    write_field_name(field_name);
+    // the chunks are formatted as JSON
+    if (!detail::is_json_sink<Sink>::value)
+    {
+        write_array(sink, begin, end, value_writer);
+        return;
+    }
 
-    return object_writer(stream());
+    detail::establish_stream_settings(sink);
+
+    detail::enter_container<Sink>();
+    detail::put(sink, '[');
+    detail::write_parallel_elements(pool, sink, begin, end, value_writer);
+    detail::put(sink, ']');
+    detail::leave_container<Sink>();
 }
 
-inline array_writer object_writer::nested_array(const char* field_name)
+template<typename Sink, typename RandomIt>
+void parallel_write_array(thread_pool& pool, Sink& sink, RandomIt begin, RandomIt end)
 {
-    detail::adjust_stream_settings(stream());
-
-    next_field();
-    write_field_name(field_name);
-
-    return array_writer(stream());
+    parallel_write_array(pool, sink, begin, end, default_value_writer<typename detail::get_value_type<RandomIt>::type>());
 }
 
-inline object_writer array_writer::nested_object()
+// A range written as an array by parallel_write_array, usable as a value:
+//
+//   writer.write("values", minijson::make_parallel_range(pool, v.begin(), v.end()));
+template<typename RandomIt, typename ValueWriter>
+struct parallel_range
 {
-    detail::adjust_stream_settings(stream());
+    thread_pool* pool;
+    RandomIt begin;
+    RandomIt end;
+    ValueWriter value_writer;
+};
 
-    next_field();
+template<typename RandomIt, typename ValueWriter>
+parallel_range<RandomIt, ValueWriter> make_parallel_range(thread_pool& pool, RandomIt begin, RandomIt end, ValueWriter value_writer)
+{
+    const parallel_range<RandomIt, ValueWriter> range = { &pool, begin, end, value_writer };
 
-    return object_writer(stream());
+    return range;
 }
 
-inline array_writer array_writer::nested_array()
+template<typename RandomIt>
+parallel_range<RandomIt, default_value_writer<typename detail::get_value_type<RandomIt>::type> > make_parallel_range(thread_pool& pool, RandomIt begin, RandomIt end)
 {
-    detail::adjust_stream_settings(stream());
-
-    next_field();
-
-    return array_writer(stream());
+    return make_parallel_range(pool, begin, end, default_value_writer<typename detail::get_value_type<RandomIt>::type>());
 }
 
-template<>
-struct default_value_writer<null_t>
+template<typename RandomIt, typename ValueWriter>
+struct default_value_writer<parallel_range<RandomIt, ValueWriter> >
 {
-    void operator()(std::ostream& stream, null_t) const
+    template<typename Sink>
+    void operator()(Sink& sink, const parallel_range<RandomIt, ValueWriter>& range) const
     {
-        stream << "null";
+        parallel_write_array(*range.pool, sink, range.begin, range.end, range.value_writer);
     }
 };
 
-#if MJW_CPP11_SUPPORTED
-template<>
-struct default_value_writer<std::nullptr_t>
+namespace detail
 {
-    void operator()(std::ostream& stream, std::nullptr_t) const
-    {
-        default_value_writer<null_t>()(stream, null);
-    }
-};
-#endif
 
-template<typename IntegralType>
-struct default_value_writer<
-        IntegralType,
-        typename detail::enable_if<MJW_LIB_NS::is_integral<IntegralType>::value && !MJW_LIB_NS::is_same<IntegralType, bool>::value>::type>
+template<typename RandomIt, typename ValueWriter>
+struct is_builtin_value<parallel_range<RandomIt, ValueWriter> >
 {
-    void operator()(std::ostream& stream, IntegralType value) const
-    {
-        // the unary plus is used here to force chars to be printed as integers
-        stream << +value;
-    }
+    static const bool value = true;
 };
 
-template<>
-struct default_value_writer<bool>
+} // namespace detail
+#endif // MJW_CPP11_SUPPORTED
+
+// Specialise struct_fields to describe the fields of a struct, then derive
+// its default_value_writer from struct_writer:
+//
+//   template<>
+//   struct struct_fields<point>
+//   {
+//       template<typename Visitor>
+//       static void visit(Visitor& visitor)
+//       {
+//           visitor(MJW_FIELD(point, x));
+//           visitor(MJW_FIELD(point, y));
+//       }
+//   };
+//
+//   template<>
+//   struct default_value_writer<point> : struct_writer<point>
+//   {
+//   };
+template<typename T>
+struct struct_fields;
+
+#define MJW_FIELD(TYPE, NAME) #NAME, &TYPE::NAME
+
+namespace detail
+{
+
+// The constant parts of the serialised struct: {"a": ,"b": ... }
+class struct_layout
 {
-    void operator()(std::ostream& stream, bool value) const
+private:
+
+    std::string m_runs;
+    std::vector<std::size_t> m_offsets; // where the run preceding each field starts
+
+public:
+
+    template<typename T>
+    struct builder
     {
-        if (value)
-        {
-            stream << "true";
-        }
-        else
+        buffer_sink sink;
+        std::vector<std::size_t> offsets;
+
+        template<typename M>
+        void operator()(const string_ref& name, M T::*)
         {
-            stream << "false";
+            offsets.push_back(sink.size());
+            put(sink, offsets.size() == 1 ? '{' : ',');
+            write_quoted_string(sink, name.data(), name.size());
+            put(sink, ':');
         }
+    };
+
+    template<typename T>
+    static const struct_layout& get()
+    {
+        static const struct_layout layout = build<T>();
+
+        return layout;
     }
-};
 
-template<typename FloatingPoint>
-struct default_value_writer<
-        FloatingPoint,
-        typename detail::enable_if<MJW_LIB_NS::is_floating_point<FloatingPoint>::value>::type>
-{
-    void operator()(std::ostream& stream, FloatingPoint value) const
+    template<typename T>
+    static struct_layout build()
     {
-        // Numeric values that cannot be represented as sequences of digits
-        // (such as Infinity and NaN) are not permitted in JSON
-        if (!MJW_ISFINITE(value))
-        {
-            default_value_writer<null_t>()(stream, null); // falling back to null
-        }
-        else
+        // the runs are only counted when written
+        const detached_instrumentation detached;
+
+        builder<T> b;
+        struct_fields<T>::visit(b);
+
+        b.offsets.push_back(b.sink.size());
+        if (b.offsets.size() == 1)
         {
-            stream << value;
+            put(b.sink, '{');
         }
+        put(b.sink, '}');
+
+        struct_layout layout;
+        layout.m_runs.assign(b.sink.data(), b.sink.size());
+        layout.m_offsets.swap(b.offsets);
+
+        return layout;
     }
-};
 
-template<>
-struct default_value_writer<char*>
-{
-    void operator()(std::ostream& stream, const char* str) const
+    // the run preceding the field with the given index, or the closing
+    // run when index is the number of fields
+    const char* run(std::size_t index) const
     {
-        detail::write_quoted_string(stream, str);
+        return m_runs.data() + m_offsets[index];
     }
-};
 
-template<>
-struct default_value_writer<const char*> : public default_value_writer<char*>
-{
-};
+    std::size_t run_size(std::size_t index) const
+    {
+        const std::size_t end = index + 1 < m_offsets.size() ? m_offsets[index + 1] : m_runs.size();
 
-template<size_t N>
-struct default_value_writer<char[N]> : public default_value_writer<char*>
-{
+        return end - m_offsets[index];
+    }
 };
 
-template<size_t N>
-struct default_value_writer<const char[N]> : public default_value_writer<char*>
+template<typename T, typename Sink>
+class struct_field_writer
 {
+private:
+
+    const struct_layout& m_layout;
+    Sink& m_sink;
+    const T& m_value;
+    std::size_t m_index;
+
+public:
+
+    struct_field_writer(const struct_layout& layout, Sink& sink, const T& value) :
+        m_layout(layout),
+        m_sink(sink),
+        m_value(value),
+        m_index(0)
+    {
+    }
+
+    template<typename Name, typename M>
+    void operator()(const Name&, M T::* member)
+    {
+        write(m_sink, m_layout.run(m_index), m_layout.run_size(m_index));
+        default_value_writer<M>()(m_sink, m_value.*member);
+        m_index++;
+    }
+
+    void finish()
+    {
+        write(m_sink, m_layout.run(m_index), m_layout.run_size(m_index));
+    }
 };
 
-template<>
-struct default_value_writer<std::string>
+template<typename T, typename Sink>
+class struct_object_writer
 {
-    void operator()(std::ostream& stream, const std::string& str) const
+private:
+
+    basic_object_writer<Sink> m_writer;
+    const T& m_value;
+
+public:
+
+    struct_object_writer(Sink& sink, const T& value) :
+        m_writer(sink),
+        m_value(value)
+    {
+    }
+
+    template<typename Name, typename M>
+    void operator()(const Name& name, M T::* member)
     {
-        default_value_writer<char*>()(stream, str.c_str());
+        m_writer.write(name, m_value.*member);
+    }
+
+    void finish()
+    {
+        m_writer.close();
     }
 };
 
-template<typename InputIt>
-void write_array(std::ostream& stream, InputIt begin, InputIt end)
-{
-    write_array(stream, begin, end, default_value_writer<typename detail::get_value_type<InputIt>::type>());
-}
+} // namespace detail
 
-template<typename InputIt, typename ValueWriter>
-void write_array(std::ostream& stream, InputIt begin, InputIt end, ValueWriter value_writer)
+// Writes the fields described by struct_fields<T>, copying the pre-rendered
+// field names and punctuation, so that only the values are formatted
+template<typename T>
+struct struct_writer
 {
-    array_writer writer(stream);
-
-    for (InputIt it = begin; it != end; ++it)
+    template<typename Sink>
+    typename detail::enable_if<detail::is_json_sink<Sink>::value>::type operator()(Sink& sink, const T& value) const
     {
-        writer.write(*it, value_writer);
+        detail::struct_field_writer<T, Sink> field_writer(detail::struct_layout::get<T>(), sink, value);
+        detail::enter_container<Sink>();
+        struct_fields<T>::visit(field_writer);
+        field_writer.finish();
+        detail::leave_container<Sink>();
     }
 
-    writer.close();
-}
+    // the pre-rendered parts are JSON: other formats write field by field
+    template<typename Sink>
+    typename detail::enable_if<!detail::is_json_sink<Sink>::value>::type operator()(Sink& sink, const T& value) const
+    {
+        detail::struct_object_writer<T, Sink> field_writer(sink, value);
+        struct_fields<T>::visit(field_writer);
+        field_writer.finish();
+    }
+};
 
 } // namespace minijson
 
@@ -0,0 +1,360 @@
+#include "minijson_writer.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Each benchmark serialises the same document with:
+// - "baseline": hand-written operator<< calls on a std::ostringstream
+// - "ostream":  minijson::object_writer/array_writer on a std::ostringstream
+// - "buffer":   minijson writers on a minijson::buffer_sink
+// and reports the throughput and the time spent per value.
+
+namespace
+{
+
+const double min_seconds = 0.3;
+
+struct data_set
+{
+    std::vector<int> small_ints;
+    std::vector<long long> large_ints;
+    std::vector<double> doubles;
+    std::vector<std::string> clean_strings;
+    std::vector<std::string> escaped_strings;
+    std::vector<int> large_range;
+};
+
+data_set make_data_set()
+{
+    data_set data;
+
+    unsigned long long state = 42;
+    for (int i = 0; i < 1000; i++)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        data.small_ints.push_back(static_cast<int>(state >> 54));
+        data.large_ints.push_back(static_cast<long long>(state) / 3);
+        data.doubles.push_back(static_cast<double>(state >> 11) / 9007199254740992.0 * 1000.0);
+    }
+
+    for (int i = 0; i < 100; i++)
+    {
+        data.clean_strings.push_back("https://example.com/some/fairly/long/path/to/a/resource?query=value&page=" + std::to_string(i));
+        data.escaped_strings.push_back("line \"" + std::to_string(i) + "\"\n\tC:\\path\\to\\file\r\n\x01 end");
+    }
+
+    for (int i = 0; i < 1000000; i++)
+    {
+        data.large_range.push_back(i);
+    }
+
+    return data;
+}
+
+// Document writers: each returns the number of values written
+
+template<typename Sink>
+size_t small_objects(Sink& sink, const data_set& data)
+{
+    minijson::basic_array_writer<Sink> writer(sink);
+    for (int i = 0; i < 100; i++)
+    {
+        minijson::basic_object_writer<Sink> object = writer.nested_object();
+        object.write("id", data.small_ints[i]);
+        object.write("value", data.doubles[i]);
+        object.write("name", "sensor");
+        object.write("active", true);
+        object.close();
+    }
+    writer.close();
+    return 400;
+}
+
+size_t small_objects_baseline(std::ostream& stream, const data_set& data)
+{
+    stream << '[';
+    for (int i = 0; i < 100; i++)
+    {
+        stream << (i > 0 ? ",{" : "{") << "\"id\":" << data.small_ints[i] << ",\"value\":" << data.doubles[i]
+               << ",\"name\":\"sensor\",\"active\":true}";
+    }
+    stream << ']';
+    return 400;
+}
+
+template<typename Sink>
+void nest(minijson::basic_array_writer<Sink>& writer, int depth)
+{
+    minijson::basic_array_writer<Sink> nested = writer.nested_array();
+    nested.write(depth);
+    if (depth > 0)
+    {
+        nest(nested, depth - 1);
+    }
+    nested.close();
+}
+
+template<typename Sink>
+size_t deep_nesting(Sink& sink, const data_set&)
+{
+    minijson::basic_array_writer<Sink> writer(sink);
+    nest(writer, 100);
+    writer.close();
+    return 101;
+}
+
+size_t deep_nesting_baseline(std::ostream& stream, const data_set&)
+{
+    for (int depth = 101; depth >= 0; depth--)
+    {
+        stream << '[';
+        if (depth <= 100)
+        {
+            stream << depth << ',';
+        }
+    }
+    for (int depth = 0; depth <= 101; depth++)
+    {
+        stream << ']';
+    }
+    return 101;
+}
+
+template<typename Sink>
+size_t int_array(Sink& sink, const data_set& data)
+{
+    minijson::basic_array_writer<Sink> writer(sink);
+    writer.write_array(data.small_ints.begin(), data.small_ints.end());
+    writer.write_array(data.large_ints.begin(), data.large_ints.end());
+    writer.close();
+    return data.small_ints.size() + data.large_ints.size();
+}
+
+template<typename Range>
+void baseline_array(std::ostream& stream, const Range& range)
+{
+    stream << '[';
+    for (typename Range::const_iterator it = range.begin(); it != range.end(); ++it)
+    {
+        if (it != range.begin())
+        {
+            stream << ',';
+        }
+        stream << *it;
+    }
+    stream << ']';
+}
+
+size_t int_array_baseline(std::ostream& stream, const data_set& data)
+{
+    stream << '[';
+    baseline_array(stream, data.small_ints);
+    stream << ',';
+    baseline_array(stream, data.large_ints);
+    stream << ']';
+    return data.small_ints.size() + data.large_ints.size();
+}
+
+template<typename Sink>
+size_t double_array(Sink& sink, const data_set& data)
+{
+    minijson::write_array(sink, data.doubles.begin(), data.doubles.end());
+    return data.doubles.size();
+}
+
+size_t double_array_baseline(std::ostream& stream, const data_set& data)
+{
+    // precision 17 so that the values round-trip, as minijson's do
+    stream.precision(17);
+    baseline_array(stream, data.doubles);
+    return data.doubles.size();
+}
+
+template<typename Sink>
+size_t clean_strings(Sink& sink, const data_set& data)
+{
+    minijson::write_array(sink, data.clean_strings.begin(), data.clean_strings.end());
+    return data.clean_strings.size();
+}
+
+void baseline_string(std::ostream& stream, const std::string& str)
+{
+    stream << '"';
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        switch (str[i])
+        {
+        case '"': stream << "\\\""; break;
+        case '\\': stream << "\\\\"; break;
+        case '\n': stream << "\\n"; break;
+        case '\r': stream << "\\r"; break;
+        case '\t': stream << "\\t"; break;
+        default:
+            if ((str[i] > 0 && str[i] < 32) || str[i] == 127)
+            {
+                char escape[8];
+                std::sprintf(escape, "\\u%04x", str[i]);
+                stream << escape;
+            }
+            else
+            {
+                stream << str[i];
+            }
+            break;
+        }
+    }
+    stream << '"';
+}
+
+size_t strings_baseline(std::ostream& stream, const std::vector<std::string>& strings)
+{
+    stream << '[';
+    for (size_t i = 0; i < strings.size(); i++)
+    {
+        if (i > 0)
+        {
+            stream << ',';
+        }
+        baseline_string(stream, strings[i]);
+    }
+    stream << ']';
+    return strings.size();
+}
+
+size_t clean_strings_baseline(std::ostream& stream, const data_set& data)
+{
+    return strings_baseline(stream, data.clean_strings);
+}
+
+template<typename Sink>
+size_t escaped_strings(Sink& sink, const data_set& data)
+{
+    minijson::write_array(sink, data.escaped_strings.begin(), data.escaped_strings.end());
+    return data.escaped_strings.size();
+}
+
+size_t escaped_strings_baseline(std::ostream& stream, const data_set& data)
+{
+    return strings_baseline(stream, data.escaped_strings);
+}
+
+template<typename Sink>
+size_t large_range(Sink& sink, const data_set& data)
+{
+    minijson::write_array(sink, data.large_range.begin(), data.large_range.end());
+    return data.large_range.size();
+}
+
+size_t large_range_baseline(std::ostream& stream, const data_set& data)
+{
+    baseline_array(stream, data.large_range);
+    return data.large_range.size();
+}
+
+// Measurement
+
+struct result
+{
+    double mb_per_second;
+    double ns_per_value;
+};
+
+template<typename Run>
+result measure(Run run)
+{
+    typedef std::chrono::steady_clock clock;
+
+    size_t iterations = 0;
+    size_t bytes = 0;
+    size_t values = 0;
+    const clock::time_point start = clock::now();
+    double elapsed;
+
+    do
+    {
+        const std::pair<size_t, size_t> bytes_and_values = run();
+        bytes += bytes_and_values.first;
+        values += bytes_and_values.second;
+        iterations++;
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    }
+    while (elapsed < min_seconds);
+
+    const result r = { bytes / elapsed / 1e6, elapsed * 1e9 / values };
+    return r;
+}
+
+typedef size_t (*stream_benchmark)(std::ostream&, const data_set&);
+typedef size_t (*buffer_benchmark)(minijson::buffer_sink&, const data_set&);
+
+struct stream_run
+{
+    stream_benchmark benchmark;
+    const data_set* data;
+
+    std::pair<size_t, size_t> operator()() const
+    {
+        std::ostringstream stream;
+        const size_t values = benchmark(stream, *data);
+        return std::make_pair(stream.str().size(), values);
+    }
+};
+
+struct buffer_run
+{
+    buffer_benchmark benchmark;
+    const data_set* data;
+    minijson::buffer_sink* sink;
+
+    std::pair<size_t, size_t> operator()() const
+    {
+        sink->clear(); // reused, as one would on a hot path
+        const size_t values = benchmark(*sink, *data);
+        return std::make_pair(sink->size(), values);
+    }
+};
+
+void report(const char* name, const char* variant, const result& r, const result& baseline)
+{
+    std::printf("%-16s %-9s %10.1f MB/s %10.2f ns/value %8.2fx\n",
+        name, variant, r.mb_per_second, r.ns_per_value, baseline.ns_per_value / r.ns_per_value);
+}
+
+void run_benchmark(const char* name, stream_benchmark baseline, stream_benchmark with_stream, buffer_benchmark with_buffer, const data_set& data)
+{
+    minijson::buffer_sink sink;
+
+    const stream_run baseline_run = { baseline, &data };
+    const stream_run ostream_run = { with_stream, &data };
+    const buffer_run buffer_sink_run = { with_buffer, &data, &sink };
+
+    const result baseline_result = measure(baseline_run);
+    report(name, "baseline", baseline_result, baseline_result);
+    report(name, "ostream", measure(ostream_run), baseline_result);
+    report(name, "buffer", measure(buffer_sink_run), baseline_result);
+}
+
+} // unnamed namespace
+
+#define MJW_BENCHMARK(NAME) \
+    run_benchmark(#NAME, NAME##_baseline, NAME<std::ostream>, NAME<minijson::buffer_sink>, data)
+
+int main()
+{
+    const data_set data = make_data_set();
+
+    std::printf("%-16s %-9s %15s %18s %9s\n", "benchmark", "variant", "throughput", "time", "speedup");
+
+    MJW_BENCHMARK(small_objects);
+    MJW_BENCHMARK(deep_nesting);
+    MJW_BENCHMARK(int_array);
+    MJW_BENCHMARK(double_array);
+    MJW_BENCHMARK(clean_strings);
+    MJW_BENCHMARK(escaped_strings);
+    MJW_BENCHMARK(large_range);
+
+    return 0;
+}
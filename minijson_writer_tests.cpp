@@ -1,10 +1,28 @@
 #include "minijson_writer.hpp"
 
 #include <sstream>
+#include <vector>
+#include <list>
+#include <iterator>
+#include <limits>
+#include <cstdio>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#endif
 
 #include <gtest/gtest.h>
 
 #define CPP11_SUPPORTED __cplusplus > 199711L || _MSC_VER >= 1800
+#define CPP14_SUPPORTED __cplusplus >= 201402L
+#define CPP17_SUPPORTED __cplusplus >= 201703L
+
+#if CPP11_SUPPORTED
+#include <thread>
+#endif
 
 TEST(minijson_writer, empty_object)
 {
@@ -96,6 +114,107 @@ TEST(minijson_writer, escaping)
     ASSERT_EQ("{\"\\\\\\\"\\\"\\u0001\\u001f\\u007f\\n\\t\\r\":\"a\\\"\\\\b\",\"int\":42}", stream.str());
 }
 
+static std::string escape_reference(const std::string& str)
+{
+    std::string result = "\"";
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        const char c = str[i];
+        if (c == '"') result += "\\\"";
+        else if (c == '\\') result += "\\\\";
+        else if (c == '\n') result += "\\n";
+        else if (c == '\r') result += "\\r";
+        else if (c == '\t') result += "\\t";
+        else if ((c > 0 && c < 32) || c == 127)
+        {
+            char escape[8];
+            sprintf(escape, "\\u%04x", c);
+            result += escape;
+        }
+        else result += c;
+    }
+    return result + "\"";
+}
+
+TEST(minijson_writer, escaping_long_strings)
+{
+    // a special character at every position of strings spanning several vector blocks,
+    // surrounded by UTF-8 sequences (which have the high bit set)
+    const char specials[] = { '"', '\\', '\n', '\x1f', '\x7f', '\x01', ' ', '\x80' };
+    for (size_t length = 1; length <= 70; length++)
+    {
+        for (size_t position = 0; position < length; position++)
+        {
+            for (size_t i = 0; i < sizeof(specials); i++)
+            {
+                std::string str(length, 'a');
+                str[(position + 1) % length] = '\xc3';
+                str[position] = specials[i];
+
+                minijson::buffer_sink sink;
+                minijson::default_value_writer<std::string>()(sink, str);
+                ASSERT_EQ(escape_reference(str), sink.str());
+            }
+        }
+    }
+}
+
+TEST(minijson_writer, sized_strings)
+{
+    const std::string with_nul("a\0b", 3);
+    const char buffer[] = "key1key2value";
+
+    std::stringstream stream;
+    minijson::object_writer writer(stream);
+    writer.write(with_nul, with_nul);
+    writer.write(minijson::string_ref(buffer, 4), minijson::string_ref(buffer + 8, 5));
+    writer.write(std::string("key2"), minijson::string_ref(buffer, 0));
+    writer.write_array(minijson::string_ref(buffer + 4, 4), &with_nul, &with_nul + 1);
+    writer.nested_object(std::string("nested")).close();
+#if CPP17_SUPPORTED
+    writer.write(std::string_view("view"), std::string_view(buffer + 8, 3));
+#endif
+    writer.close();
+
+    const char* const expected =
+        "{\"a\\u0000b\":\"a\\u0000b\",\"key1\":\"value\",\"key2\":\"\",\"key2\":[\"a\\u0000b\"],\"nested\":{}"
+#if CPP17_SUPPORTED
+        ",\"view\":\"val\""
+#endif
+        "}";
+    ASSERT_EQ(expected, stream.str());
+}
+
+TEST(minijson_writer, keys)
+{
+#if CPP14_SUPPORTED
+    constexpr auto name_key = minijson::make_key("name");
+#else
+    const minijson::static_key<5> name_key = minijson::make_key("name");
+#endif
+    static const minijson::key values_key("val\"ues");
+    static const minijson::key nested_key(std::string("nested"));
+    const int values[] = { 1, 2 };
+
+    minijson::buffer_sink sink;
+    minijson::basic_object_writer<minijson::buffer_sink> writer(sink);
+    writer.write(name_key, "foo");
+    writer.write_array(values_key, values, values + 2);
+    {
+        minijson::basic_object_writer<minijson::buffer_sink> nested_writer = writer.nested_object(nested_key);
+        nested_writer.write(name_key, 42, minijson::default_value_writer<int>());
+        nested_writer.nested_array(minijson::make_key("empty")).close();
+        nested_writer.close();
+    }
+    writer.close();
+
+    ASSERT_EQ("{\"name\":\"foo\",\"val\\\"ues\":[1,2],\"nested\":{\"name\":42,\"empty\":[]}}", sink.str());
+
+    // names needing an escape do not compile as constants, and throw otherwise
+    const char quoted[] = { 'a', '"', 'b', '\0' };
+    ASSERT_THROW(minijson::make_key(quoted), std::invalid_argument);
+}
+
 TEST(minijson_writer, empty_string)
 {
     std::stringstream stream;
@@ -150,6 +269,65 @@ TEST(minijson_writer, nesting_complex)
         stream.str());
 }
 
+#if CPP11_SUPPORTED
+template<typename Builder, typename = void>
+struct can_write_field : std::false_type
+{
+};
+
+template<typename Builder>
+struct can_write_field<Builder, decltype(void(std::declval<Builder>().field("name", 42)))> : std::true_type
+{
+};
+
+TEST(minijson_writer, static_builder)
+{
+    typedef decltype(minijson::build_object(std::declval<std::ostream&>())) object_builder;
+    typedef decltype(minijson::build_array(std::declval<std::ostream&>())) array_builder;
+    static_assert(can_write_field<object_builder>::value, "fields can be written on objects");
+    static_assert(!can_write_field<object_builder&>::value, "builders cannot be reused");
+    static_assert(!can_write_field<array_builder>::value, "arrays have no fields");
+    static_assert(!std::is_copy_constructible<object_builder>::value, "builders cannot be copied");
+    static_assert(!std::is_move_constructible<object_builder>::value, "builders cannot be moved");
+    static_assert(!std::is_copy_constructible<array_builder>::value, "builders cannot be copied");
+    static_assert(!std::is_move_constructible<array_builder>::value, "builders cannot be moved");
+
+    {
+        std::stringstream stream;
+        minijson::build_array(stream)
+            .value("value1")
+            .object()
+                .field("field2", "value2")
+                .array("nested2")
+                    .value("value3")
+                    .value(std::string("value4"))
+                    .array()
+                        .value("value5")
+                        .object().close()
+                    .close()
+                    .value("value6")
+                .close()
+                .array("nestedempty").close()
+            .close()
+        .close();
+        ASSERT_EQ(
+            "[\"value1\",{\"field2\":\"value2\",\"nested2\":[\"value3\",\"value4\",[\"value5\",{}],\"value6\"],\"nestedempty\":[]}]",
+            stream.str());
+    }
+    {
+        static const minijson::key type_key("type");
+        minijson::buffer_sink sink;
+        minijson::build_object(sink)
+            .field(type_key, 21, [](minijson::buffer_sink& sink, int value) { minijson::default_value_writer<int>()(sink, value * 2); })
+            .field("x", 1.5)
+            .field("valid", true)
+            .object("empty").close()
+        .close();
+        ASSERT_EQ("{\"type\":42,\"x\":1.5,\"valid\":true,\"empty\":{}}", sink.str());
+    }
+}
+#endif
+
 TEST(minijson_writer, write_array)
 {
     std::vector<std::string> elements;
@@ -177,6 +355,132 @@ TEST(minijson_writer, write_array)
     }
 }
 
+// Contiguous ranges of numbers are formatted in bulk: the output must match
+// the one of the same values in a std::list, written element by element
+template<typename Number>
+void check_number_span(const std::vector<Number>& values)
+{
+    const std::list<Number> list(values.begin(), values.end());
+    std::stringstream expected;
+    minijson::write_array(expected, list.begin(), list.end());
+
+    {
+        std::stringstream stream;
+        minijson::write_array(stream, values.begin(), values.end());
+        ASSERT_EQ(expected.str(), stream.str());
+    }
+    {
+        minijson::buffer_sink sink;
+        minijson::basic_object_writer<minijson::buffer_sink> writer(sink);
+        writer.write_array("values", values.data(), values.data() + values.size());
+        writer.close();
+        ASSERT_EQ("{\"values\":" + expected.str() + "}", sink.str());
+    }
+    {
+        std::vector<char> buffer(expected.str().size());
+        minijson::fixed_buffer_sink sink(buffer.data(), buffer.size());
+        const std::vector<Number>& const_values = values;
+        minijson::write_array(sink, const_values.begin(), const_values.end());
+        ASSERT_FALSE(sink.overflow());
+        ASSERT_EQ(expected.str(), std::string(buffer.begin(), buffer.end()));
+    }
+}
+
+TEST(minijson_writer, write_array_numbers)
+{
+    std::vector<int> ints;
+    std::vector<long long> longs;
+    std::vector<double> doubles;
+    std::vector<float> floats;
+    for (int i = 0; i < 1000; i++)
+    {
+        ints.push_back(i * 7919 - 3000000);
+        longs.push_back((i % 2 ? -1 : 1) * (static_cast<long long>(i) << 50));
+        doubles.push_back(i / 7.0 - 50);
+        floats.push_back(static_cast<float>(i) / 3);
+    }
+    doubles[10] = std::numeric_limits<double>::quiet_NaN();
+    doubles[11] = std::numeric_limits<double>::infinity();
+    doubles[12] = -0.0;
+
+    check_number_span(ints);
+    check_number_span(longs);
+    check_number_span(doubles);
+    check_number_span(floats);
+    check_number_span(std::vector<unsigned char>(3, 200));
+    check_number_span(std::vector<int>());
+
+    {
+        // a custom precision is still honoured
+        std::stringstream stream;
+        stream << std::setprecision(3);
+        minijson::write_array(stream, doubles.begin() + 1, doubles.begin() + 3);
+        ASSERT_EQ("[-49.9,-49.7]", stream.str());
+    }
+}
+
+TEST(minijson_writer, raw_json)
+{
+    std::stringstream stream;
+    minijson::object_writer writer(stream);
+    writer.write("config", minijson::raw_json("{\"debug\":true}"));
+    minijson::array_writer nested = writer.nested_array("list");
+    nested.write(minijson::raw_json(std::string("[1,2]")));
+    nested.write(minijson::raw_json("null", 4));
+    nested.close();
+    writer.close();
+    ASSERT_EQ("{\"config\":{\"debug\":true},\"list\":[[1,2],null]}", stream.str());
+}
+
+struct counting_renderer
+{
+    int* calls;
+    int value;
+
+    void operator()(minijson::buffer_sink& sink) const
+    {
+        (*calls)++;
+        minijson::basic_object_writer<minijson::buffer_sink> writer(sink);
+        writer.write("value", value);
+        writer.close();
+    }
+};
+
+TEST(minijson_writer, subtree_cache)
+{
+    minijson::subtree_cache<> cache;
+    int calls = 0;
+    const int first = 0;
+    const int second = 0;
+
+    counting_renderer renderer = { &calls, 1 };
+    minijson::raw_json json = cache.get(&first, 1, renderer);
+    ASSERT_EQ("{\"value\":1}", std::string(json.data(), json.size()));
+    ASSERT_EQ(1, calls);
+
+    renderer.value = 2;
+    json = cache.get(&first, 1, renderer);
+    ASSERT_EQ("{\"value\":1}", std::string(json.data(), json.size())); // cached
+    json = cache.get(&first, 2, renderer);
+    ASSERT_EQ("{\"value\":2}", std::string(json.data(), json.size())); // new version
+    json = cache.get(&second, renderer);
+    ASSERT_EQ(3, calls);
+    ASSERT_EQ(2U, cache.size());
+
+    cache.invalidate(&first);
+    renderer.value = 3;
+    std::stringstream stream;
+    minijson::array_writer writer(stream);
+    writer.write(cache.get(&first, 2, renderer));
+    writer.write(cache.get(&second, renderer));
+    writer.close();
+    ASSERT_EQ("[{\"value\":3},{\"value\":2}]", stream.str());
+    ASSERT_EQ(4, calls);
+
+    cache.clear();
+    ASSERT_EQ(0U, cache.size());
+}
+
 TEST(minijson_writer, utf8)
 {
     std::stringstream stream;
@@ -186,6 +490,79 @@ TEST(minijson_writer, utf8)
     ASSERT_EQ("{\"à\\\"èẁ\\\"\":\"你\\\\好!\"}", stream.str());
 }
 
+template<typename IntegralType>
+static std::string format_with_stream(IntegralType value)
+{
+    std::ostringstream stream;
+    stream << +value;
+    return stream.str();
+}
+
+template<typename IntegralType>
+static void check_integral_limits()
+{
+    const IntegralType values[] =
+    {
+        std::numeric_limits<IntegralType>::min(),
+        static_cast<IntegralType>(std::numeric_limits<IntegralType>::min() + 1),
+        static_cast<IntegralType>(0),
+        static_cast<IntegralType>(9),
+        static_cast<IntegralType>(10),
+        static_cast<IntegralType>(99),
+        static_cast<IntegralType>(100),
+        static_cast<IntegralType>(std::numeric_limits<IntegralType>::max() - 1),
+        std::numeric_limits<IntegralType>::max()
+    };
+
+    std::string expected = "[";
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+        expected += (i > 0 ? "," : "") + format_with_stream(values[i]);
+    }
+    expected += "]";
+
+    std::stringstream stream;
+    minijson::write_array(stream, values, values + sizeof(values) / sizeof(values[0]));
+    ASSERT_EQ(expected, stream.str());
+
+    minijson::buffer_sink sink;
+    minijson::write_array(sink, values, values + sizeof(values) / sizeof(values[0]));
+    ASSERT_EQ(expected, sink.str());
+}
+
+TEST(minijson_writer, integral_formatting)
+{
+    check_integral_limits<char>();
+    check_integral_limits<signed char>();
+    check_integral_limits<unsigned char>();
+    check_integral_limits<short>();
+    check_integral_limits<unsigned short>();
+    check_integral_limits<int>();
+    check_integral_limits<unsigned int>();
+    check_integral_limits<long>();
+    check_integral_limits<unsigned long>();
+    check_integral_limits<long long>();
+    check_integral_limits<unsigned long long>();
+
+    // every digit count, on both sides of each power of ten
+    minijson::buffer_sink sink;
+    minijson::basic_array_writer<minijson::buffer_sink> writer(sink);
+    std::string expected = "[";
+    long long power = 1;
+    for (int i = 0; i < 18; i++, power *= 10)
+    {
+        const long long values[] = { power - 1, power, -power, -(power - 1) };
+        for (size_t j = 0; j < 4; j++)
+        {
+            writer.write(values[j]);
+            expected += (expected.size() > 1 ? "," : "") + format_with_stream(values[j]);
+        }
+    }
+    writer.close();
+    expected += "]";
+    ASSERT_EQ(expected, sink.str());
+}
+
 static double return_zero() // to suppress VS2013 compiler errors
 {
     return 0.0;
@@ -212,6 +589,125 @@ TEST(minijson_writer, float_formatting)
     ASSERT_EQ("[3.141592653590]", stream.str());
 }
 
+TEST(minijson_writer, float_shortest)
+{
+    const double values[] = { 42.4242424, 0.1, -0.0, 1e-4, 1.5e-5, 1e16, 1e17, 123456789.125, 5e-324, 1.7976931348623157e308 };
+
+    {
+        std::stringstream stream;
+        minijson::write_array(stream, values, values + sizeof(values) / sizeof(values[0]));
+        ASSERT_EQ("[42.4242424,0.1,-0,0.0001,1.5e-05,10000000000000000,1e+17,123456789.125,5e-324,1.7976931348623157e+308]", stream.str());
+    }
+    {
+        minijson::buffer_sink sink;
+        minijson::basic_array_writer<minijson::buffer_sink> writer(sink);
+        writer.write(0.1f);
+        writer.write(3.4028235e38f);
+        writer.write(16777216.0f);
+        writer.close();
+        ASSERT_EQ("[0.1,3.4028235e+38,16777216]", sink.str());
+    }
+    {
+        std::stringstream stream;
+        stream << std::setprecision(3);
+        minijson::array_writer writer(stream);
+        writer.write(3.1415926535897);
+        writer.close();
+        ASSERT_EQ("[3.14]", stream.str());
+    }
+    {
+        // a precision of 6 is only honoured when asked explicitly
+        std::stringstream stream;
+        stream << std::setprecision(6);
+        minijson::write_array(stream, values, values + 1);
+        stream << minijson::use_stream_precision;
+        minijson::write_array(stream, values, values + 1);
+        stream << minijson::use_default_precision;
+        minijson::write_array(stream, values, values + 1);
+        ASSERT_EQ("[42.4242424][42.4242][42.4242424]", stream.str());
+    }
+    {
+        minijson::buffer_sink sink;
+        minijson::basic_array_writer<minijson::buffer_sink> writer(sink);
+        writer.write(0.5L);
+        writer.write(static_cast<long double>(-1e300));
+        writer.write(1.0L / 3);
+        writer.close();
+        const std::string str = sink.str();
+        ASSERT_EQ(0U, str.find("[0.5,-1e+300,"));
+        if (std::numeric_limits<long double>::digits > std::numeric_limits<double>::digits)
+        {
+            long double value;
+            std::istringstream(str.substr(13, str.size() - 14)) >> value;
+            ASSERT_EQ(1.0L / 3, value);
+        }
+    }
+    if (std::numeric_limits<long double>::digits > std::numeric_limits<double>::digits)
+    {
+        // only the decimal point is replaced, not the sign or the exponent
+        minijson::buffer_sink sink;
+        minijson::default_value_writer<long double>()(sink, -1.0L / 3e30L);
+        const std::string str = sink.str();
+        ASSERT_EQ(0U, str.find("-3.3333"));
+        ASSERT_NE(std::string::npos, str.find("e-31"));
+        long double value;
+        std::istringstream(str) >> value;
+        ASSERT_EQ(-1.0L / 3e30L, value);
+    }
+}
+
+#if CPP11_SUPPORTED
+template<typename Duration>
+std::string write_time(Duration since_epoch)
+{
+    std::stringstream stream;
+    minijson::default_value_writer<std::chrono::time_point<std::chrono::system_clock, Duration> >()(stream,
+        std::chrono::time_point<std::chrono::system_clock, Duration>(since_epoch));
+    return stream.str();
+}
+
+TEST(minijson_writer, timestamps)
+{
+    using std::chrono::seconds;
+    using std::chrono::milliseconds;
+    using std::chrono::microseconds;
+    using std::chrono::nanoseconds;
+
+    ASSERT_EQ("\"1970-01-01T00:00:00Z\"", write_time(seconds(0)));
+    ASSERT_EQ("\"2024-05-17T08:30:00.250Z\"", write_time(milliseconds(1715934600250LL)));
+    ASSERT_EQ("\"2024-05-17T08:30:00.250000Z\"", write_time(microseconds(1715934600250000LL)));
+    ASSERT_EQ("\"2024-05-17T08:30:00.000000009Z\"", write_time(nanoseconds(1715934600000000009LL)));
+    ASSERT_EQ("\"1969-12-31T23:59:59.999Z\"", write_time(milliseconds(-1)));
+    ASSERT_EQ("\"2000-02-29T23:59:59Z\"", write_time(seconds(951868799)));
+    ASSERT_EQ("\"2000-03-01T00:00:00Z\"", write_time(seconds(951868800)));
+    ASSERT_EQ("\"2100-03-01T00:00:00Z\"", write_time(seconds(4107542400LL)));
+    ASSERT_EQ("\"9999-12-31T23:59:59Z\"", write_time(seconds(253402300799LL)));
+    ASSERT_EQ("\"+10000-01-01T00:00:00Z\"", write_time(seconds(253402300800LL)));
+    ASSERT_EQ("\"0001-01-01T00:00:00Z\"", write_time(seconds(-62135596800LL)));
+    ASSERT_EQ("\"-0001-12-31T23:59:59Z\"", write_time(seconds(-62135596800LL - 366 * 86400 - 1)));
+    ASSERT_EQ("\"1970-01-01T00:00:00.500Z\"", write_time(std::chrono::duration<long long, std::centi>(50)));
+
+    // consecutive timestamps in the same second and day
+    ASSERT_EQ("\"2024-05-17T08:30:00.251Z\"", write_time(milliseconds(1715934600251LL)));
+    ASSERT_EQ("\"2024-05-17T23:59:59.999Z\"", write_time(milliseconds(1715990399999LL)));
+    ASSERT_EQ("\"2024-05-18T00:00:00Z\"", write_time(seconds(1715990400LL)));
+
+    const std::chrono::time_point<std::chrono::system_clock, nanoseconds> time(nanoseconds(1715934600123456789LL));
+    const std::chrono::time_point<std::chrono::system_clock, nanoseconds> before_epoch(nanoseconds(-1));
+    std::stringstream stream;
+    minijson::array_writer writer(stream);
+    writer.write(time);
+    writer.write(time, minijson::timestamp_writer<milliseconds>());
+    writer.write(time, minijson::timestamp_writer<seconds>());
+    writer.write(time, minijson::epoch_writer<milliseconds>());
+    writer.write(before_epoch, minijson::epoch_writer<milliseconds>());
+    writer.write(std::chrono::system_clock::time_point(), minijson::epoch_writer<seconds>());
+    writer.close();
+    ASSERT_EQ("[\"2024-05-17T08:30:00.123456789Z\",\"2024-05-17T08:30:00.123Z\",\"2024-05-17T08:30:00Z\",1715934600123,-1,0]",
+        stream.str());
+}
+#endif
+
 TEST(minijson_writer, bad_stream_flags)
 {
     std::stringstream stream;
@@ -226,6 +722,24 @@ TEST(minijson_writer, bad_stream_flags)
     ASSERT_EQ("[42,42,42]", stream.str());
 }
 
+TEST(minijson_writer, bad_stream_flags_nested)
+{
+    std::stringstream stream;
+    stream << std::showpos << std::hex;
+    minijson::object_writer writer(stream);
+    {
+        minijson::array_writer nested_writer = writer.nested_array("nested");
+        nested_writer.write(42);
+        stream << std::showpoint << std::setw(10);
+        nested_writer.write(42.0);
+        nested_writer.close();
+    }
+    stream << std::oct;
+    writer.write("int", 42);
+    writer.close();
+    ASSERT_EQ("{\"nested\":[42,42],\"int\":42}", stream.str());
+}
+
 enum point_type
 {
     FIXED, MOVING
@@ -320,6 +834,62 @@ TEST(minijson_writer, custom_value_writer_array)
     }
 }
 
+template<typename Sink>
+void write_measured_document(Sink& sink)
+{
+    const int ints[] = { 0, -7, 42, std::numeric_limits<int>::min() };
+    const std::vector<double> doubles(3, 0.1);
+
+    minijson::basic_object_writer<Sink> writer(sink);
+    writer.write("int", std::numeric_limits<long long>::max());
+    writer.write("unsigned", 1000000U);
+    writer.write("double", -1.5e-300);
+    writer.write("nan", std::numeric_limits<double>::quiet_NaN());
+    writer.write("bool", false);
+    writer.write("null", minijson::null);
+    writer.write("escaped \"name\"", "tab\tquote\"control\x01\x7f");
+    writer.write("nul", std::string("a\0b", 3));
+    writer.write(minijson::make_key("key"), minijson::raw_json("{\"raw\":1}"));
+    writer.write_array("ints", ints, ints + 4);
+    writer.write_array("doubles", doubles.begin(), doubles.end());
+    minijson::basic_array_writer<Sink> nested = writer.nested_array("nested");
+    nested.write("\xc3\xa8");
+    nested.nested_object().close();
+    nested.close();
+    writer.close();
+}
+
+TEST(minijson_writer, counting_sink)
+{
+    minijson::buffer_sink buffer;
+    write_measured_document(buffer);
+
+    minijson::counting_sink counter;
+    write_measured_document(counter);
+    ASSERT_EQ(buffer.size(), counter.size());
+
+    counter.clear();
+    ASSERT_EQ(0U, counter.size());
+
+    {
+        // value writers taking a std::ostream need a counting_ostream
+        const point_type types[] = { FIXED, MOVING };
+        const point3d point = { -1, 1, 0.5 };
+
+        std::stringstream stream;
+        minijson::counting_ostream counting_stream;
+        for (int i = 0; i < 2; i++)
+        {
+            std::ostream& target = i == 0 ? static_cast<std::ostream&>(stream) : counting_stream;
+            minijson::array_writer writer(target);
+            writer.write(point);
+            writer.write_array(types, types + 2, point_type_writer());
+            writer.close();
+        }
+        ASSERT_EQ(stream.str().size(), counting_stream.size());
+    }
+}
+
 TEST(minijson_writer, remove_locale)
 {
     std::stringstream stream;
@@ -347,6 +917,1168 @@ TEST(minijson_writer, remove_locale)
     ASSERT_EQ("{\"foo\":1000.25}", stream.str());
 }
 
+TEST(minijson_writer, buffer_sink)
+{
+    minijson::buffer_sink sink;
+    minijson::basic_object_writer<minijson::buffer_sink> writer(sink);
+    writer.write("int", -42);
+    writer.write("double", 42.42);
+    writer.write("string", std::string("a\"b"));
+    {
+        minijson::basic_array_writer<minijson::buffer_sink> nested_writer = writer.nested_array("nested");
+        nested_writer.write(true);
+        nested_writer.write(minijson::null);
+        nested_writer.close();
+    }
+    const int values[] = { 1, 2 };
+    writer.write_array("values", values, values + 2);
+    writer.close();
+    ASSERT_EQ("{\"int\":-42,\"double\":42.42,\"string\":\"a\\\"b\",\"nested\":[true,null],\"values\":[1,2]}", sink.str());
+
+    sink.clear();
+    minijson::write_array(sink, values, values + 2);
+    ASSERT_EQ("[1,2]", std::string(sink.data(), sink.size()));
+}
+
+TEST(minijson_writer, buffer_pool)
+{
+    minijson::buffer_pool pool(16, 2);
+    const std::string long_string(1000, 'x');
+
+    const minijson::buffer_sink* first;
+    {
+        minijson::buffer_pool::handle buffer(pool);
+        first = &buffer.sink();
+        minijson::basic_array_writer<minijson::buffer_sink> writer(buffer.sink());
+        writer.write(long_string);
+        writer.close();
+        ASSERT_EQ(long_string.size() + 4, buffer.size());
+        ASSERT_EQ('"', buffer.data()[1]);
+    }
+    ASSERT_EQ(long_string.size() + 4, pool.high_water());
+    ASSERT_EQ(1U, pool.pooled());
+    {
+        // reused, cleared and already grown to the high-water mark
+        minijson::buffer_pool::handle buffer(pool);
+        ASSERT_EQ(first, &buffer.sink());
+        ASSERT_EQ(0U, buffer.size());
+        ASSERT_LE(pool.high_water(), buffer.sink().capacity());
+
+        minijson::buffer_pool::handle second(pool);
+        minijson::buffer_pool::handle third(pool);
+        ASSERT_EQ(0U, pool.pooled());
+        ASSERT_LE(pool.high_water(), third.sink().capacity());
+    }
+    ASSERT_EQ(2U, pool.pooled()); // the third buffer was freed
+
+#if CPP11_SUPPORTED
+    ASSERT_EQ(&minijson::buffer_pool::local(), &minijson::buffer_pool::local());
+#endif
+}
+
+TEST(minijson_writer, fixed_buffer_sink)
+{
+    char buffer[8];
+    minijson::fixed_buffer_sink sink(buffer, sizeof(buffer));
+    minijson::basic_array_writer<minijson::fixed_buffer_sink> writer(sink);
+    writer.write(1);
+    writer.write(2);
+    writer.close();
+    ASSERT_EQ("[1,2]", std::string(sink.data(), sink.size()));
+    ASSERT_FALSE(sink.overflow());
+
+    sink.clear();
+    minijson::write_array(sink, "abcdefgh", "abcdefgh" + 8);
+    ASSERT_EQ("[97,98,9", std::string(sink.data(), sink.size()));
+    ASSERT_TRUE(sink.overflow());
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+static std::string read_file(int fd)
+{
+    std::string content;
+    char buffer[4096];
+    ssize_t size;
+    lseek(fd, 0, SEEK_SET);
+    while ((size = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        content.append(buffer, static_cast<size_t>(size));
+    }
+    return content;
+}
+
+static int make_temporary_file()
+{
+    char path[] = "/tmp/minijson_writer_testXXXXXX";
+    const int fd = mkstemp(path);
+    unlink(path);
+    return fd;
+}
+
+TEST(minijson_writer, fd_sink)
+{
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    const std::vector<int> values(100, 7);
+    {
+        minijson::fd_sink sink(fds[1], 4);
+        minijson::basic_object_writer<minijson::fd_sink> writer(sink);
+        writer.write("foo", "bar");
+        writer.write("baz", 42);
+        writer.write_array("values", values.begin(), values.end());
+        writer.close();
+    }
+    close(fds[1]);
+
+    char buffer[64];
+    std::string output;
+    ssize_t size;
+    while ((size = read(fds[0], buffer, sizeof(buffer))) > 0)
+    {
+        output.append(buffer, static_cast<size_t>(size));
+    }
+    close(fds[0]);
+    std::stringstream expected;
+    minijson::write_array(expected, values.begin(), values.end());
+    ASSERT_EQ("{\"foo\":\"bar\",\"baz\":42,\"values\":" + expected.str() + "}", output);
+}
+
+TEST(minijson_writer, mmap_sink)
+{
+    const int fd = make_temporary_file();
+    ASSERT_NE(-1, fd);
+    ASSERT_EQ(static_cast<ssize_t>(10), write(fd, "0123456789", 10)); // overwritten
+
+    std::vector<int> values;
+    for (int i = 0; i < 5000; i++)
+    {
+        values.push_back(i);
+    }
+    std::string expected;
+    {
+        minijson::mmap_sink::options options;
+        options.extent_size = 1; // one page
+        options.async_msync = true;
+        minijson::mmap_sink sink(fd, options);
+        minijson::basic_object_writer<minijson::mmap_sink> writer(sink);
+        writer.write("string", std::string(10000, 'x'));
+        writer.write_array("values", values.begin(), values.end());
+        writer.close();
+
+        minijson::buffer_sink buffer;
+        minijson::basic_object_writer<minijson::buffer_sink> expected_writer(buffer);
+        expected_writer.write("string", std::string(10000, 'x'));
+        expected_writer.write_array("values", values.begin(), values.end());
+        expected_writer.close();
+        expected = buffer.str();
+
+        ASSERT_EQ(expected.size(), sink.size());
+        sink.close();
+        sink.put('x'); // ignored
+        ASSERT_EQ(0, sink.error());
+    }
+    ASSERT_EQ(expected, read_file(fd));
+    close(fd);
+
+    {
+        minijson::mmap_sink sink(-1);
+        sink.write("abc", 3);
+        minijson::write_array(sink, values.begin(), values.end());
+        ASSERT_EQ(EBADF, sink.error());
+        ASSERT_EQ(0U, sink.size());
+    }
+}
+
+TEST(minijson_writer, iovec_sink)
+{
+    const std::string payload(5000, 'x');
+    const std::string escaped_payload = payload + "\n" + payload;
+
+    minijson::iovec_sink sink(1000);
+    minijson::basic_object_writer<minijson::iovec_sink> writer(sink);
+    writer.write("short", minijson::external_string("copied"));
+    writer.write("payload", minijson::external_string(payload));
+    writer.write("escaped", minijson::external_string(escaped_payload));
+    writer.write("copied", payload);
+    writer.close();
+
+    const std::string expected = "{\"short\":\"copied\",\"payload\":\"" + payload + "\",\"escaped\":\""
+        + payload + "\\n" + payload + "\",\"copied\":\"" + payload + "\"}";
+    ASSERT_EQ(expected.size(), sink.size());
+    ASSERT_EQ(3 * payload.size(), sink.referenced_size());
+
+    std::vector<struct iovec> iov;
+    sink.gather(iov);
+    ASSERT_EQ(7U, iov.size());
+    ASSERT_EQ(payload.data(), iov[1].iov_base);
+
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    ASSERT_EQ(0, sink.write_to(fds[1]));
+    ASSERT_EQ(0, sink.send_to(fds[1]));
+    close(fds[1]);
+
+    char buffer[4096];
+    std::string output;
+    ssize_t size;
+    while ((size = read(fds[0], buffer, sizeof(buffer))) > 0)
+    {
+        output.append(buffer, static_cast<size_t>(size));
+    }
+    close(fds[0]);
+    ASSERT_EQ(expected + expected, output);
+
+    {
+        // other sinks copy external strings
+        std::stringstream stream;
+        minijson::array_writer writer(stream);
+        writer.write(minijson::external_string("a\"b"));
+        writer.close();
+        ASSERT_EQ("[\"a\\\"b\"]", stream.str());
+    }
+}
+#endif
+
+#if defined(MJW_ENABLE_ZLIB)
+// Decompresses gzip or zlib data, complete or not
+static std::string inflate_all(const std::string& compressed)
+{
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    inflateInit2(&stream, 15 + 32);
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data()));
+    stream.avail_in = static_cast<uInt>(compressed.size());
+
+    std::string output;
+    char buffer[4096];
+    int status;
+    do
+    {
+        stream.next_out = reinterpret_cast<Bytef*>(buffer);
+        stream.avail_out = sizeof(buffer);
+        status = inflate(&stream, Z_NO_FLUSH);
+        output.append(buffer, sizeof(buffer) - stream.avail_out);
+    }
+    while (status == Z_OK && stream.avail_out == 0);
+    inflateEnd(&stream);
+
+    return output;
+}
+
+TEST(minijson_writer, deflate_sink)
+{
+    std::vector<int> values;
+    for (int i = 0; i < 100000; i++)
+    {
+        values.push_back(i % 1000);
+    }
+
+    minijson::buffer_sink expected;
+    minijson::write_array(expected, values.begin(), values.end());
+
+    for (int format = minijson::GZIP; format <= minijson::ZLIB; format++)
+    {
+        std::stringstream stream;
+        {
+            minijson::deflate_sink<std::ostream> sink(stream, 9, static_cast<minijson::deflate_format>(format));
+            minijson::write_array(sink, values.begin(), values.end());
+            ASSERT_EQ(0, sink.error());
+        }
+        ASSERT_LT(stream.str().size(), expected.size() / 10);
+        ASSERT_EQ(expected.str(), inflate_all(stream.str()));
+    }
+
+    {
+        // each record can be decompressed as soon as it is flushed
+        minijson::buffer_sink compressed;
+        minijson::deflate_sink<minijson::buffer_sink> sink(compressed);
+        std::string records;
+        for (int i = 0; i < 3; i++)
+        {
+            minijson::basic_object_writer<minijson::deflate_sink<minijson::buffer_sink> > writer(sink);
+            writer.write("record", i);
+            writer.close();
+            sink.put('\n');
+            sink.flush();
+
+            records += "{\"record\":" + std::string(1, static_cast<char>('0' + i)) + "}\n";
+            ASSERT_EQ(records, inflate_all(compressed.str()));
+        }
+        sink.finish();
+        ASSERT_EQ(records, inflate_all(compressed.str()));
+    }
+}
+#endif
+
+struct comma_numpunct : std::numpunct<char>
+{
+    char do_decimal_point() const
+    {
+        return ',';
+    }
+
+    char do_thousands_sep() const
+    {
+        return '.';
+    }
+
+    std::string do_grouping() const
+    {
+        return "\3";
+    }
+};
+
+TEST(minijson_writer, remove_custom_locale)
+{
+    std::stringstream stream;
+    stream.imbue(std::locale(std::locale::classic(), new comma_numpunct));
+
+    stream << 1000.25;
+    ASSERT_EQ("1.000,25", stream.str());
+
+    stream.str("");
+
+    minijson::object_writer writer(stream);
+    {
+        minijson::array_writer nested_writer = writer.nested_array("nested");
+        nested_writer.write(1000.25);
+        nested_writer.write(1000);
+        nested_writer.close();
+    }
+    writer.write("foo", 1000.25);
+    writer.close();
+
+    ASSERT_EQ("{\"nested\":[1000.25,1000],\"foo\":1000.25}", stream.str());
+}
+
+TEST(minijson_writer, custom_locale_mid_document)
+{
+    std::stringstream stream;
+    stream << std::fixed << std::setprecision(2);
+
+    minijson::object_writer writer(stream);
+    writer.write("a", 1.5);
+    stream.imbue(std::locale(std::locale::classic(), new comma_numpunct));
+    writer.write("b", 2.5);
+    {
+        minijson::array_writer nested_writer = writer.nested_array("nested");
+        stream.imbue(std::locale(std::locale::classic(), new comma_numpunct));
+        nested_writer.write(1234567.25);
+        nested_writer.close();
+    }
+    stream.imbue(std::locale(std::locale::classic(), new comma_numpunct));
+    writer.write("c", 1234567.25);
+    writer.close();
+
+    ASSERT_EQ("{\"a\":1.50,\"b\":2.50,\"nested\":[1234567.25],\"c\":1234567.25}", stream.str());
+}
+
+struct coordinates
+{
+    double n;
+    double w;
+};
+
+struct city
+{
+    std::string name;
+    coordinates position;
+    int population;
+    double area;
+    char country[3];
+};
+
+struct empty_struct
+{
+};
+
+namespace minijson
+{
+
+template<>
+struct struct_fields<coordinates>
+{
+    template<typename Visitor>
+    static void visit(Visitor& visitor)
+    {
+        visitor(MJW_FIELD(coordinates, n));
+        visitor(MJW_FIELD(coordinates, w));
+    }
+};
+
+template<>
+struct default_value_writer<coordinates> : struct_writer<coordinates>
+{
+};
+
+template<>
+struct struct_fields<city>
+{
+    template<typename Visitor>
+    static void visit(Visitor& visitor)
+    {
+        visitor(MJW_FIELD(city, name));
+        visitor(MJW_FIELD(city, position));
+        visitor("pop\"ulation", &city::population);
+        visitor(MJW_FIELD(city, area));
+        visitor(MJW_FIELD(city, country));
+    }
+};
+
+template<>
+struct default_value_writer<city> : struct_writer<city>
+{
+};
+
+template<>
+struct struct_fields<empty_struct>
+{
+    template<typename Visitor>
+    static void visit(Visitor&)
+    {
+    }
+};
+
+template<>
+struct default_value_writer<empty_struct> : struct_writer<empty_struct>
+{
+};
+
+} // namespace minijson
+
+TEST(minijson_writer, struct_writer)
+{
+    const city cities[] =
+    {
+        { "Los Angeles", { 34.05, 118.25 }, 3898747, 1302.15, "US" },
+        { "Rome", { 41.9, -12.5 }, 2761632, 1285.31, "IT" }
+    };
+    const std::string expected =
+        "[{\"name\":\"Los Angeles\",\"position\":{\"n\":34.05,\"w\":118.25},\"pop\\\"ulation\":3898747,\"area\":1302.15,\"country\":\"US\"},"
+        "{\"name\":\"Rome\",\"position\":{\"n\":41.9,\"w\":-12.5},\"pop\\\"ulation\":2761632,\"area\":1285.31,\"country\":\"IT\"}]";
+
+    {
+        std::stringstream stream;
+        minijson::write_array(stream, cities, cities + 2);
+        ASSERT_EQ(expected, stream.str());
+    }
+    {
+        minijson::buffer_sink sink;
+        minijson::write_array(sink, cities, cities + 2);
+        ASSERT_EQ(expected, sink.str());
+    }
+    {
+        const empty_struct empty = empty_struct();
+        std::stringstream stream;
+        minijson::object_writer writer(stream);
+        writer.write("empty", empty);
+        writer.close();
+        ASSERT_EQ("{\"empty\":{}}", stream.str());
+    }
+}
+
+#if defined(MJW_ENABLE_INSTRUMENTATION)
+static minijson::writer_stats last_document;
+
+static void record_document(const minijson::writer_stats& document)
+{
+    last_document = document;
+}
+
+TEST(minijson_writer, instrumentation)
+{
+    const point3d point = { -1, 1, 0 };
+    const std::vector<int> ints(100, 7);
+
+    minijson::thread_writer_stats() = minijson::writer_stats();
+    minijson::set_document_callback(record_document);
+
+    std::stringstream first;
+    {
+        minijson::object_writer writer(first);
+        writer.write("int", 42);
+        writer.write("double", 0.5);
+        writer.write("string", "a\"b\n");
+        writer.write("null", minijson::null);
+        writer.write("bool", true);
+        writer.write("type", MOVING, point_type_writer());
+        minijson::array_writer nested = writer.nested_array("nested");
+        nested.nested_array().close();
+        nested.close();
+        writer.close();
+    }
+    ASSERT_EQ(first.str().size(), last_document.bytes);
+    ASSERT_EQ(1U, last_document.integrals);
+    ASSERT_EQ(1U, last_document.floating_points);
+    ASSERT_EQ(2U, last_document.strings); // including the custom value's
+    ASSERT_EQ(1U, last_document.nulls);
+    ASSERT_EQ(1U, last_document.booleans);
+    ASSERT_EQ(1U, last_document.custom_values);
+    ASSERT_EQ(2U, last_document.escapes);
+    ASSERT_EQ(3U, last_document.max_depth);
+    ASSERT_EQ(1U, last_document.documents);
+
+    std::stringstream stream;
+    {
+        minijson::array_writer writer(stream);
+        writer.write(point);
+        writer.write_array(ints.begin(), ints.end());
+        writer.close();
+    }
+    ASSERT_EQ(stream.str().size(), last_document.bytes);
+    ASSERT_EQ(100U, last_document.integrals);
+    ASSERT_EQ(3U, last_document.floating_points);
+    ASSERT_EQ(1U, last_document.custom_values);
+    ASSERT_EQ(2U, last_document.max_depth);
+
+    minijson::set_document_callback(NULL);
+    minijson::counting_sink counting;
+    minijson::write_array(counting, ints.begin(), ints.end()); // not counted
+    minijson::buffer_sink sink;
+    minijson::cbor_sink<minijson::buffer_sink> cbor(sink);
+    minijson::write_array(cbor, ints.begin(), ints.begin() + 10);
+
+    const minijson::writer_stats& totals = minijson::thread_writer_stats();
+    ASSERT_EQ(3U, totals.documents);
+    ASSERT_EQ(111U, totals.integrals);
+    ASSERT_EQ(3U, totals.max_depth);
+    ASSERT_EQ(first.str().size() + stream.str().size() + sink.size(), totals.bytes);
+    ASSERT_EQ(100U, last_document.integrals); // the callback was removed
+
+    // buffered output (keys, struct layouts, parallel chunks) is only counted once written
+    minijson::thread_writer_stats() = minijson::writer_stats();
+    minijson::set_document_callback(record_document);
+
+    const minijson::key escaped_key("a\"b");
+    ASSERT_EQ(0U, totals.bytes);
+    ASSERT_EQ(0U, totals.escapes);
+    minijson::buffer_sink key_sink;
+    minijson::basic_object_writer<minijson::buffer_sink> key_writer(key_sink);
+    key_writer.write(escaped_key, 1);
+    key_writer.close();
+    ASSERT_EQ(key_sink.size(), last_document.bytes);
+
+    const coordinates position = { 34.05, 118.25 };
+    minijson::buffer_sink struct_sink;
+    minijson::default_value_writer<coordinates>()(struct_sink, position);
+    ASSERT_EQ(struct_sink.size(), last_document.bytes);
+    ASSERT_EQ(2U, last_document.floating_points);
+    ASSERT_EQ(1U, last_document.max_depth);
+    ASSERT_EQ(2U, totals.documents);
+
+    minijson::thread_pool pool(4);
+    const std::vector<coordinates> points(5000, position);
+    minijson::buffer_sink parallel_sink;
+    minijson::parallel_write_array(pool, parallel_sink, points.begin(), points.end());
+    ASSERT_EQ(parallel_sink.size(), last_document.bytes);
+    ASSERT_EQ(5000U, last_document.custom_values);
+    ASSERT_EQ(10000U, last_document.floating_points);
+    ASSERT_EQ(2U, last_document.max_depth);
+    ASSERT_EQ(3U, totals.documents);
+    ASSERT_EQ(key_sink.size() + struct_sink.size() + parallel_sink.size(), totals.bytes);
+    minijson::set_document_callback(NULL);
+}
+#endif
+
+static std::string to_hex(const std::string& bytes)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (size_t i = 0; i < bytes.size(); i++)
+    {
+        hex += digits[static_cast<unsigned char>(bytes[i]) >> 4];
+        hex += digits[static_cast<unsigned char>(bytes[i]) & 0xf];
+    }
+    return hex;
+}
+
+template<typename Sink>
+void write_binary_document(Sink& sink)
+{
+    static const minijson::key quote_key("k\"");
+    const int values[] = { 1, 2, 3 };
+    const coordinates position = { 1.5, -2 };
+
+    minijson::basic_object_writer<Sink> writer(sink);
+    writer.write("a", 1);
+    minijson::basic_array_writer<Sink> nested = writer.nested_array("b");
+    nested.write(true);
+    nested.write(minijson::null);
+    nested.write(-1);
+    nested.write(1.5);
+    nested.close();
+    writer.write("c", "xy");
+    writer.write("d", -1000);
+    writer.write("e", 0.1);
+    writer.write(quote_key, 300);
+    writer.write_array("v", values, values + 3);
+    writer.write("p", position);
+    writer.close();
+}
+
+TEST(minijson_writer, binary_encodings)
+{
+    {
+        std::stringstream stream;
+        minijson::cbor_sink<std::ostream> sink(stream);
+        write_binary_document(sink);
+        ASSERT_EQ(
+            "bf" "616101" "61629ff5f620fa3fc00000ff" "6163627879" "61643903e7" "6165fb3fb999999999999a"
+            "626b2219012c" "617683010203" "6170bf616efa3fc000006177fac0000000ff" "ff",
+            to_hex(stream.str()));
+    }
+    {
+        minijson::msgpack_sink sink;
+        write_binary_document(sink);
+        ASSERT_EQ(
+            "df00000008" "a16101" "a162dd00000004c3c0ffca3fc00000" "a163a27879" "a164d1fc18" "a165cb3fb999999999999a"
+            "a26b22cd012c" "a17693010203" "a170df00000002a16eca3fc00000a177cac0000000",
+            to_hex(sink.str()));
+    }
+    {
+        // large values and indefinite ranges
+        std::istringstream words("x y");
+        minijson::buffer_sink buffer;
+        minijson::cbor_sink<minijson::buffer_sink> sink(buffer);
+        minijson::basic_array_writer<minijson::cbor_sink<minijson::buffer_sink> > writer(sink);
+        writer.write(std::numeric_limits<long long>::min());
+        writer.write(4294967296ULL);
+        writer.write(std::string(300, 'z'));
+        writer.write_array(std::istream_iterator<std::string>(words), std::istream_iterator<std::string>());
+        writer.close();
+        ASSERT_EQ("9f" "3b7fffffffffffffff" "1b0000000100000000" "7901" "2c" + to_hex(std::string(300, 'z')) + "9f61786179ff" "ff",
+            to_hex(buffer.str()));
+    }
+    {
+        minijson::msgpack_sink sink;
+        minijson::basic_array_writer<minijson::msgpack_sink> writer(sink);
+        writer.write(std::numeric_limits<long long>::min());
+        writer.write(-33);
+        writer.write(200U);
+        writer.write(std::string(40, 'z'));
+        writer.close();
+        ASSERT_EQ("dd00000004" "d38000000000000000" "d0df" "ccc8" "d928" + to_hex(std::string(40, 'z')), to_hex(sink.str()));
+    }
+    {
+        // keys are written unescaped
+        static const minijson::key escaped_key("a\"b\n");
+        minijson::msgpack_sink sink;
+        minijson::basic_object_writer<minijson::msgpack_sink> writer(sink);
+        writer.write(escaped_key, 1);
+        writer.write(minijson::make_key("c"), 2);
+        writer.close();
+        ASSERT_EQ("df00000002" "a46122620a01" "a16302", to_hex(sink.str()));
+    }
+    if (sizeof(size_t) > 4)
+    {
+        // MessagePack lengths have at most 32 bits: the header is never written
+        const size_t huge = static_cast<size_t>(0xffffffffULL) + 1;
+        minijson::msgpack_sink sink;
+        minijson::basic_array_writer<minijson::msgpack_sink> writer(sink);
+        ASSERT_THROW(writer.write(minijson::string_ref("", huge)), std::length_error);
+        ASSERT_THROW(writer.write(minijson::binary_ref("", huge)), std::length_error);
+        ASSERT_EQ("dd", to_hex(sink.str()).substr(0, 2));
+        ASSERT_EQ(5U, sink.size());
+    }
+#if CPP11_SUPPORTED
+    {
+        minijson::msgpack_sink sink;
+        minijson::build_object(sink).field("a", 1).array("b").value(true).close().close();
+        ASSERT_EQ("df00000002" "a16101" "a162dd00000001c3", to_hex(sink.str()));
+    }
+#endif
+}
+
+static std::string reference_base64(const std::string& data, minijson::base64_alphabet alphabet)
+{
+    const char* const table = alphabet == minijson::BASE64_URL ?
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_" :
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string result;
+    unsigned bits = 0;
+    int bit_count = 0;
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        bits = (bits << 8) | static_cast<unsigned char>(data[i]);
+        bit_count += 8;
+        while (bit_count >= 6)
+        {
+            bit_count -= 6;
+            result += table[(bits >> bit_count) & 0x3f];
+        }
+    }
+    if (bit_count > 0)
+    {
+        result += table[(bits << (6 - bit_count)) & 0x3f];
+    }
+    while (alphabet == minijson::BASE64_STANDARD && result.size() % 4 != 0)
+    {
+        result += '=';
+    }
+    return result;
+}
+
+TEST(minijson_writer, binary)
+{
+    const char* const rfc_inputs[] = { "", "f", "fo", "foo", "foob", "fooba", "foobar" };
+    const char* const rfc_outputs[] = { "\"\"", "\"Zg==\"", "\"Zm8=\"", "\"Zm9v\"", "\"Zm9vYg==\"", "\"Zm9vYmE=\"", "\"Zm9vYmFy\"" };
+    for (size_t i = 0; i < 7; i++)
+    {
+        std::stringstream stream;
+        minijson::default_value_writer<minijson::binary_ref>()(stream, minijson::binary_ref(rfc_inputs[i], std::strlen(rfc_inputs[i])));
+        ASSERT_EQ(rfc_outputs[i], stream.str());
+    }
+
+    const unsigned char url_unsafe[] = { 0xfb, 0xff };
+    {
+        std::stringstream stream;
+        minijson::array_writer writer(stream);
+        writer.write(minijson::binary_ref(url_unsafe, 2));
+        writer.write(minijson::binary_ref(url_unsafe, 2, minijson::BASE64_URL));
+        writer.close();
+        ASSERT_EQ("[\"+/8=\",\"-_8\"]", stream.str());
+    }
+
+    // every length up to 100, then lengths around the 768-byte blocks, through
+    // the vectorised (see "make simd") and the scalar paths
+    std::string data;
+    unsigned long long state = 1;
+    for (int i = 0; i < 5000; i++)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        data += static_cast<char>(state >> 56);
+    }
+    std::vector<size_t> sizes;
+    for (size_t size = 0; size <= 100; size++)
+    {
+        sizes.push_back(size);
+    }
+    for (size_t block_end = 768; block_end <= data.size(); block_end += 768 * 2 + 1)
+    {
+        for (size_t size = block_end - 13; size <= block_end + 13; size++)
+        {
+            sizes.push_back(size);
+        }
+    }
+    sizes.push_back(data.size());
+    for (size_t i = 0; i < sizes.size(); i++)
+    {
+        const size_t size = sizes[i];
+        const std::string input = data.substr(0, size);
+        for (int alphabet = minijson::BASE64_STANDARD; alphabet <= minijson::BASE64_URL; alphabet++)
+        {
+            const minijson::binary_ref value(input.data(), input.size(), static_cast<minijson::base64_alphabet>(alphabet));
+            const std::string expected = "{\"data\":\"" + reference_base64(input, value.alphabet()) + "\"}";
+
+            std::stringstream stream;
+            minijson::object_writer writer(stream);
+            writer.write("data", value);
+            writer.close();
+            ASSERT_EQ(expected, stream.str());
+
+            minijson::buffer_sink buffer;
+            minijson::basic_object_writer<minijson::buffer_sink> buffer_writer(buffer);
+            buffer_writer.write("data", value);
+            buffer_writer.close();
+            ASSERT_EQ(expected, buffer.str());
+
+            minijson::counting_sink counting;
+            minijson::basic_object_writer<minijson::counting_sink> counting_writer(counting);
+            counting_writer.write("data", value);
+            counting_writer.close();
+            ASSERT_EQ(expected.size(), counting.size());
+        }
+    }
+
+    // byte strings in the binary formats
+    {
+        minijson::buffer_sink buffer;
+        minijson::cbor_sink<minijson::buffer_sink> sink(buffer);
+        minijson::default_value_writer<minijson::binary_ref>()(sink, minijson::binary_ref("abc", 3));
+        minijson::default_value_writer<minijson::binary_ref>()(sink, minijson::binary_ref(data.data(), 300));
+        ASSERT_EQ("43616263" "59012c" + to_hex(data.substr(0, 300)), to_hex(buffer.str()));
+    }
+    {
+        const std::string large(70000, 'z');
+        minijson::msgpack_sink sink;
+        minijson::basic_array_writer<minijson::msgpack_sink> writer(sink);
+        writer.write(minijson::binary_ref("abc", 3));
+        writer.write(minijson::binary_ref(data.data(), 300));
+        writer.write(minijson::binary_ref(large.data(), large.size()));
+        writer.close();
+        ASSERT_EQ("dd00000003" "c403616263" "c5012c" + to_hex(data.substr(0, 300)) + "c600011170" + to_hex(large),
+            to_hex(sink.str()));
+    }
+}
+
+struct recording_sink
+{
+    std::string data;
+    int writes;
+    int flushes;
+
+    recording_sink() : writes(0), flushes(0)
+    {
+    }
+
+    void put(char c)
+    {
+        data += c;
+        writes++;
+    }
+
+    void write(const char* str, size_t size)
+    {
+        data.append(str, size);
+        writes++;
+    }
+
+    void flush()
+    {
+        flushes++;
+    }
+};
+
+TEST(minijson_writer, ndjson_writer)
+{
+    recording_sink sink;
+    std::vector<unsigned long long> offsets;
+    {
+        minijson::ndjson_writer<recording_sink>::options options;
+        options.max_records = 3;
+        minijson::ndjson_writer<recording_sink> records(sink, options);
+
+        for (int i = 0; i < 4; i++)
+        {
+            minijson::basic_object_writer<minijson::buffer_sink> writer = records.object();
+            writer.write("index", i);
+            writer.close();
+            offsets.push_back(records.commit());
+        }
+        offsets.push_back(records.write(std::string("text")));
+        ASSERT_EQ(1, sink.writes);
+        ASSERT_EQ(1, sink.flushes);
+        ASSERT_EQ(2U, records.pending_records());
+        ASSERT_EQ(5U, records.records());
+
+        // the record being written is not flushed
+        minijson::basic_array_writer<minijson::buffer_sink> writer = records.array();
+        writer.write(1);
+        records.flush();
+        writer.write(2);
+        writer.close();
+        offsets.push_back(records.commit());
+        ASSERT_EQ(2, sink.writes);
+        ASSERT_EQ(2, sink.flushes);
+
+        minijson::basic_object_writer<minijson::buffer_sink> discarded = records.object();
+        discarded.write("discarded", true);
+    } // the destructor flushes the committed records
+
+    ASSERT_EQ("{\"index\":0}\n{\"index\":1}\n{\"index\":2}\n{\"index\":3}\n\"text\"\n[1,2]\n", sink.data);
+    ASSERT_EQ(3, sink.writes);
+    const unsigned long long expected_offsets[] = { 0, 12, 24, 36, 48, 55 };
+    ASSERT_EQ(std::vector<unsigned long long>(expected_offsets, expected_offsets + 6), offsets);
+
+    // byte policy
+    std::stringstream stream;
+    {
+        minijson::ndjson_writer<std::ostream>::options options;
+        options.max_bytes = 100;
+        minijson::ndjson_writer<std::ostream> records(stream, options);
+        for (int i = 0; i < 20; i++)
+        {
+            records.write(i * 1000);
+            if (i == 18)
+            {
+                ASSERT_EQ(101U, stream.str().size());
+            }
+        }
+        ASSERT_EQ(101U, stream.str().size());
+        ASSERT_EQ(stream.str().size() + 6, records.offset());
+    }
+    ASSERT_EQ(107U, stream.str().size());
+
+#if CPP11_SUPPORTED
+    // time policy
+    recording_sink timed_sink;
+    minijson::ndjson_writer<recording_sink>::options options;
+    options.max_delay = std::chrono::milliseconds(10);
+    minijson::ndjson_writer<recording_sink> records(timed_sink, options);
+    records.write(1);
+    records.flush_if_due();
+    ASSERT_EQ(0, timed_sink.writes);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    records.flush_if_due();
+    ASSERT_EQ("1\n", timed_sink.data);
+#endif
+}
+
+#if CPP11_SUPPORTED && (defined(__unix__) || defined(__APPLE__))
+TEST(minijson_writer, async_log_sink)
+{
+    const int fd = make_temporary_file();
+    ASSERT_NE(-1, fd);
+
+    const int thread_count = 4;
+    const int records_per_thread = 5000;
+    {
+        minijson::async_log_sink::options options;
+        options.flush_bytes = 1000;
+        minijson::async_log_sink log(fd, options);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < thread_count; t++)
+        {
+            threads.push_back(std::thread([&log, t]()
+            {
+                for (int i = 0; i < records_per_thread; i++)
+                {
+                    minijson::async_log_sink::record record(log);
+                    minijson::basic_object_writer<minijson::buffer_sink> writer(record.sink());
+                    writer.write("thread", t);
+                    writer.write("index", i);
+                    writer.write("message", std::string(i % 100, 'x'));
+                    writer.close();
+                    record.commit();
+                }
+            }));
+        }
+        for (size_t t = 0; t < threads.size(); t++)
+        {
+            threads[t].join();
+        }
+    } // the destructor drains the queue
+
+    // every record is complete, and the records of each thread are in order
+    std::istringstream lines(read_file(fd));
+    close(fd);
+    std::vector<int> next_index(thread_count, 0);
+    std::string line;
+    int count = 0;
+    while (std::getline(lines, line))
+    {
+        int thread;
+        int index;
+        ASSERT_EQ(2, sscanf(line.c_str(), "{\"thread\":%d,\"index\":%d,", &thread, &index)) << line;
+        ASSERT_EQ(next_index[thread]++, index);
+
+        std::stringstream expected;
+        minijson::object_writer writer(expected);
+        writer.write("thread", thread);
+        writer.write("index", index);
+        writer.write("message", std::string(index % 100, 'x'));
+        writer.close();
+        ASSERT_EQ(expected.str(), line);
+        count++;
+    }
+    ASSERT_EQ(thread_count * records_per_thread, count);
+
+    // a lone record is written once it has waited flush_interval
+    const int idle_fd = make_temporary_file();
+    ASSERT_NE(-1, idle_fd);
+    {
+        minijson::async_log_sink::options options;
+        options.flush_interval = std::chrono::milliseconds(10);
+        minijson::async_log_sink log(idle_fd, options);
+        log.publish("{}", 2);
+        for (int i = 0; i < 500 && lseek(idle_fd, 0, SEEK_CUR) == 0; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        ASSERT_EQ(3, lseek(idle_fd, 0, SEEK_CUR));
+    }
+    ASSERT_EQ("{}\n", read_file(idle_fd));
+    close(idle_fd);
+}
+#endif
+
+#if CPP11_SUPPORTED && defined(__linux__)
+template<typename Sink>
+void write_pulled_document(Sink& sink)
+{
+    minijson::basic_array_writer<Sink> writer(sink);
+    for (int i = 0; i < 200; i++)
+    {
+        minijson::basic_object_writer<Sink> object = writer.nested_object();
+        object.write("id", i * 1234567);
+        object.write("value", i / 3.0);
+        object.write("text", std::string(i, 'x') + "\"\n");
+        object.close();
+    }
+    writer.close();
+}
+
+struct destruction_flag
+{
+    bool* destroyed;
+
+    ~destruction_flag()
+    {
+        *destroyed = true;
+    }
+};
+
+static int consume_stack(int depth)
+{
+    volatile char frame[1024];
+    frame[0] = static_cast<char>(depth);
+    return depth == 0 ? frame[0] : consume_stack(depth - 1) + frame[0];
+}
+
+TEST(minijson_writer, pull_serializer)
+{
+    minijson::buffer_sink expected;
+    write_pulled_document(expected);
+
+    const size_t chunk_sizes[] = { 1, 7, 4096 };
+    for (size_t chunk_size : chunk_sizes)
+    {
+        minijson::pull_serializer serializer(write_pulled_document<minijson::pull_serializer::sink>);
+        std::vector<char> chunk(chunk_size);
+        std::string output;
+        size_t size;
+        while ((size = serializer.pull(chunk.data(), chunk.size())) > 0)
+        {
+            ASSERT_LE(size, chunk_size);
+            output.append(chunk.data(), size);
+        }
+        ASSERT_TRUE(serializer.done());
+        ASSERT_EQ(expected.str(), output);
+    }
+
+    {
+        minijson::pull_serializer serializer([](minijson::pull_serializer::sink& sink)
+        {
+            minijson::write_array(sink, "abc", "abc" + 3); // [97,98,99]
+            throw std::runtime_error("failed");
+        });
+        char chunk[8];
+        ASSERT_EQ(8U, serializer.pull(chunk, sizeof(chunk)));
+        ASSERT_THROW(serializer.pull(chunk, sizeof(chunk)), std::runtime_error);
+        ASSERT_EQ(0U, serializer.pull(chunk, sizeof(chunk)));
+    }
+
+    {
+        // abandoning a document unwinds the producer
+        bool destroyed = false;
+        {
+            minijson::pull_serializer serializer([&destroyed](minijson::pull_serializer::sink& sink)
+            {
+                const destruction_flag flag = { &destroyed };
+                write_pulled_document(sink);
+            });
+            char chunk[16];
+            ASSERT_EQ(sizeof(chunk), serializer.pull(chunk, sizeof(chunk)));
+            ASSERT_FALSE(destroyed);
+        }
+        ASSERT_TRUE(destroyed);
+    }
+
+    // overflowing the producer's stack hits the guard page
+    ASSERT_DEATH(
+    {
+        minijson::pull_serializer serializer([](minijson::pull_serializer::sink& sink)
+        {
+            minijson::default_value_writer<int>()(sink, consume_stack(1000));
+        }, 16 * 1024);
+        char chunk[16];
+        serializer.pull(chunk, sizeof(chunk));
+    }, "");
+}
+#endif
+
+#if CPP11_SUPPORTED
+TEST(minijson_writer, parallel_write_array)
+{
+    minijson::thread_pool pool(4);
+
+    std::vector<int> ints;
+    std::vector<double> doubles;
+    std::vector<point_type> types;
+    for (int i = 0; i < 100000; i++)
+    {
+        ints.push_back(i * 7919 - 1000000);
+        doubles.push_back(i / 3.0);
+        types.push_back(i % 3 == 0 ? FIXED : MOVING);
+    }
+
+    {
+        std::stringstream serial;
+        minijson::write_array(serial, ints.begin(), ints.end());
+        std::stringstream parallel;
+        minijson::parallel_write_array(pool, parallel, ints.begin(), ints.end());
+        ASSERT_EQ(serial.str(), parallel.str());
+    }
+    {
+        // the formatting settings of the target stream are honoured
+        std::stringstream serial;
+        serial << std::fixed << std::setprecision(3);
+        minijson::write_array(serial, doubles.begin(), doubles.end());
+        std::stringstream parallel;
+        parallel << std::fixed << std::setprecision(3) << std::showpos;
+        minijson::parallel_write_array(pool, parallel, doubles.begin(), doubles.end());
+        ASSERT_EQ(serial.str(), parallel.str());
+    }
+    {
+        // and so is use_stream_precision, even with a precision of 6
+        const std::vector<double> thirds(5000, 1.0 / 3);
+        const int precisions[] = { 6, 10 };
+        for (int precision : precisions)
+        {
+            std::stringstream serial;
+            serial << std::setprecision(precision) << minijson::use_stream_precision;
+            minijson::write_array(serial, thirds.begin(), thirds.end());
+            std::stringstream parallel;
+            parallel << std::setprecision(precision) << minijson::use_stream_precision;
+            minijson::parallel_write_array(pool, parallel, thirds.begin(), thirds.end());
+            ASSERT_EQ(serial.str(), parallel.str());
+            ASSERT_EQ(0U, parallel.str().find(precision == 6 ? "[0.333333," : "[0.3333333333,"));
+        }
+    }
+    {
+        // value writers taking a std::ostream
+        std::stringstream serial;
+        minijson::write_array(serial, types.begin(), types.end(), point_type_writer());
+        std::stringstream parallel;
+        minijson::parallel_write_array(pool, parallel, types.begin(), types.end(), point_type_writer());
+        ASSERT_EQ(serial.str(), parallel.str());
+    }
+    {
+        minijson::buffer_sink serial;
+        minijson::basic_object_writer<minijson::buffer_sink> serial_writer(serial);
+        serial_writer.write_array("doubles", doubles.begin(), doubles.end());
+        serial_writer.write_array("empty", ints.begin(), ints.begin());
+        serial_writer.write_array("one", ints.begin(), ints.begin() + 1);
+        serial_writer.close();
+
+        minijson::buffer_sink parallel;
+        minijson::basic_object_writer<minijson::buffer_sink> parallel_writer(parallel);
+        parallel_writer.write("doubles", minijson::make_parallel_range(pool, doubles.begin(), doubles.end()));
+        parallel_writer.write("empty", minijson::make_parallel_range(pool, ints.begin(), ints.begin()));
+        parallel_writer.write("one", minijson::make_parallel_range(pool, ints.begin(), ints.begin() + 1));
+        parallel_writer.close();
+
+        ASSERT_EQ(serial.str(), parallel.str());
+    }
+    {
+        // a value writer using the same pool runs its range serially instead of deadlocking
+        const std::vector<std::vector<int> > nested(3000, std::vector<int>(ints.begin(), ints.begin() + 300));
+        minijson::buffer_sink serial;
+        minijson::write_array(serial, nested.begin(), nested.end(), [](minijson::buffer_sink& sink, const std::vector<int>& values)
+        {
+            minijson::write_array(sink, values.begin(), values.end());
+        });
+        minijson::buffer_sink parallel;
+        minijson::parallel_write_array(pool, parallel, nested.begin(), nested.end(), [&pool](minijson::buffer_sink& sink, const std::vector<int>& values)
+        {
+            minijson::parallel_write_array(pool, sink, values.begin(), values.end());
+        });
+        ASSERT_EQ(serial.str(), parallel.str());
+    }
+}
+#endif
+
 int main(int argc, char** argv)
 {
     testing::InitGoogleTest(&argc, argv);